@@ -0,0 +1,361 @@
+/*
+ * CRC-32 for the DFU file suffix
+ *
+ * The suffix CRC covers the whole file, so for large images it is worth
+ * more than a byte at a time table lookup. Slice-by-8 handles eight bytes
+ * per step with eight tables; where the CPU can do better (carry-less
+ * multiplication on x86, the CRC32 instructions of ARMv8) that is chosen
+ * at runtime. The byte-wise loop is kept as the reference.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "portable.h"
+#include "crc32.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define CRC32_ARMV8
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/* reflected IEEE 802.3 polynomial */
+#define CRC32_POLY 0xedb88320
+
+static const uint32_t crc32_table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
+
+uint32_t crc32_bytewise(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/* crc32_slice[k][n] is the CRC of byte n followed by k zero bytes */
+static uint32_t crc32_slice[8][256];
+
+typedef uint32_t (*crc32_func)(uint32_t crc, const void *buf, size_t len);
+
+static crc32_func crc32_impl;
+static const char *crc32_impl_name;
+
+static void crc32_slice_init(void)
+{
+	int k, n;
+
+	for (n = 0; n < 256; n++)
+		crc32_slice[0][n] = crc32_table[n];
+	for (k = 1; k < 8; k++) {
+		for (n = 0; n < 256; n++) {
+			uint32_t c = crc32_slice[k - 1][n];
+
+			crc32_slice[k][n] = crc32_table[c & 0xff] ^ (c >> 8);
+		}
+	}
+}
+
+static uint32_t crc32_slice8_run(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+				     (uint32_t)p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 |
+			      (uint32_t)p[7] << 24;
+
+		crc = crc32_slice[7][lo & 0xff] ^
+		      crc32_slice[6][(lo >> 8) & 0xff] ^
+		      crc32_slice[5][(lo >> 16) & 0xff] ^
+		      crc32_slice[4][lo >> 24] ^
+		      crc32_slice[3][hi & 0xff] ^
+		      crc32_slice[2][(hi >> 8) & 0xff] ^
+		      crc32_slice[1][(hi >> 16) & 0xff] ^
+		      crc32_slice[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32_PCLMUL
+
+/*
+ * Folds 64 bytes per step with carry-less multiplication, then reduces
+ * the 128 bit remainder with a Barrett reduction, as described in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ". The
+ * constants are those of the bit-reflected IEEE polynomial. Note that the
+ * SSE4.2 crc32 instruction computes CRC-32C, a different polynomial.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i x1, x2, x3, x4, k, t;
+	size_t n;
+
+	if (len < 64)
+		return crc32_slice8_run(crc, buf, len);
+	n = len & ~(size_t)15;
+
+	x1 = _mm_loadu_si128((const __m128i *)p);
+	x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	n -= 64;
+
+#define CRC32_FOLD(x, next) do { \
+		t = _mm_clmulepi64_si128(x, k, 0x00); \
+		x = _mm_clmulepi64_si128(x, k, 0x11); \
+		x = _mm_xor_si128(_mm_xor_si128(x, t), next); \
+	} while (0)
+
+	/* x^(512+32) and x^(512-32) mod P */
+	k = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+	while (n >= 64) {
+		CRC32_FOLD(x1, _mm_loadu_si128((const __m128i *)p));
+		CRC32_FOLD(x2, _mm_loadu_si128((const __m128i *)(p + 16)));
+		CRC32_FOLD(x3, _mm_loadu_si128((const __m128i *)(p + 32)));
+		CRC32_FOLD(x4, _mm_loadu_si128((const __m128i *)(p + 48)));
+		p += 64;
+		n -= 64;
+	}
+
+	/* x^(128+32) and x^(128-32) mod P */
+	k = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+	CRC32_FOLD(x1, x2);
+	CRC32_FOLD(x1, x3);
+	CRC32_FOLD(x1, x4);
+	while (n >= 16) {
+		CRC32_FOLD(x1, _mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		n -= 16;
+	}
+#undef CRC32_FOLD
+
+	/* 128 to 64 bits */
+	t = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+
+	/* 64 to 32 bits, x^64 mod P */
+	k = _mm_set_epi64x(0, 0x163cd6124);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction with P and x^64 / P */
+	k = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+	x2 = x1;
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = _mm_extract_epi32(x1, 1);
+
+	return crc32_slice8_run(crc, p, len & 15);
+}
+
+#endif /* CRC32_PCLMUL */
+
+#ifdef CRC32_ARMV8
+
+static uint32_t crc32_armv8(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len && ((uintptr_t)p & 7)) {
+		__asm__(".arch_extension crc\n\tcrc32b %w0, %w0, %w1"
+			: "+r" (crc) : "r" ((uint32_t)*p));
+		p++;
+		len--;
+	}
+	while (len >= 8) {
+		__asm__(".arch_extension crc\n\tcrc32x %w0, %w0, %x1"
+			: "+r" (crc) : "r" (*(const uint64_t *)p));
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		__asm__(".arch_extension crc\n\tcrc32b %w0, %w0, %w1"
+			: "+r" (crc) : "r" ((uint32_t)*p));
+		p++;
+	}
+	return crc;
+}
+
+#endif /* CRC32_ARMV8 */
+
+static void crc32_select(void)
+{
+	crc32_slice_init();
+	crc32_impl = crc32_slice8_run;
+	crc32_impl_name = "slice-by-8";
+#ifdef CRC32_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1")) {
+		crc32_impl = crc32_pclmul;
+		crc32_impl_name = "pclmulqdq";
+	}
+#endif
+#ifdef CRC32_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32_impl = crc32_armv8;
+		crc32_impl_name = "armv8-crc32";
+	}
+#endif
+}
+
+static void crc32_init(void)
+{
+#ifdef HAVE_PTHREAD_H
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, crc32_select);
+#else
+	if (!crc32_impl)
+		crc32_select();
+#endif
+}
+
+uint32_t crc32_slice8(uint32_t crc, const void *buf, size_t len)
+{
+	crc32_init();
+	return crc32_slice8_run(crc, buf, len);
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	crc32_init();
+	return crc32_impl(crc, buf, len);
+}
+
+const char *crc32_method(void)
+{
+	crc32_init();
+	return crc32_impl_name;
+}
+
+/* a * b mod P, for reflected polynomials */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	while (1) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^(n * 2^k) mod P */
+static uint32_t crc32_x2nmodp(size_t n, unsigned int k)
+{
+	uint32_t p = (uint32_t)1 << 31;		/* x^0 */
+	uint32_t x2k = (uint32_t)1 << 30;	/* x^1 */
+
+	/* x^(2^k) for k = 0, 1, 2, ... by squaring */
+	while (k--)
+		x2k = crc32_multmodp(x2k, x2k);
+	while (n) {
+		if (n & 1)
+			p = crc32_multmodp(x2k, p);
+		n >>= 1;
+		x2k = crc32_multmodp(x2k, x2k);
+	}
+	return p;
+}
+
+/*
+ * Combines the running value crc1 over a first block with crc2, the
+ * value over a following block of len2 bytes started from 0. This lets
+ * separate chunks of a file be checksummed independently.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2;
+}
@@ -0,0 +1,18 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 as used in the DFU suffix (IEEE 802.3 polynomial, reflected).
+ * The running value is passed in and returned without the final
+ * inversion, so a DFU suffix CRC starts from 0xffffffff.
+ */
+uint32_t crc32_bytewise(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_slice8(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+const char *crc32_method(void);
+
+#endif /* CRC32_H */
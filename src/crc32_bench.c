@@ -0,0 +1,114 @@
+/*
+ * Microbenchmark for the DFU suffix CRC-32
+ *
+ * Compares the byte-wise table loop, slice-by-8 and the implementation
+ * chosen at runtime on a buffer of pseudo-random data, and checks that
+ * they agree, also when the buffer is checksummed in chunks that are
+ * combined afterwards.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "portable.h"
+#include "crc32.h"
+
+#define BENCH_ROUNDS 8
+#define BENCH_CHUNKS 4
+
+typedef uint32_t (*crc32_func)(uint32_t crc, const void *buf, size_t len);
+
+static double bench_seconds(void)
+{
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static uint32_t bench(const char *name, crc32_func func,
+		      const unsigned char *buf, size_t len)
+{
+	uint32_t crc = 0;
+	double start, elapsed;
+	int i;
+
+	start = bench_seconds();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		crc = func(0xffffffff, buf, len);
+	elapsed = bench_seconds() - start;
+	if (elapsed <= 0)
+		elapsed = 1e-6;
+	printf("%-12s %08x %10.1f MB/s\n", name, crc,
+	       (double)len * BENCH_ROUNDS / elapsed / (1024 * 1024));
+	return crc;
+}
+
+int main(int argc, char **argv)
+{
+	size_t len = 16 * 1024 * 1024;
+	unsigned char *buf;
+	uint32_t ref, crc, seed = 1;
+	size_t i, chunk;
+	int failed = 0;
+
+	if (argc > 1) {
+		len = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+		if (!len)
+			errx(EX_USAGE, "Usage: %s [megabytes]", argv[0]);
+	}
+	buf = malloc(len);
+	if (!buf)
+		errx(EX_SOFTWARE, "Cannot allocate %lu bytes", (unsigned long)len);
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	printf("%lu bytes, runtime choice is %s\n", (unsigned long)len,
+	       crc32_method());
+	ref = bench("byte-wise", crc32_bytewise, buf, len);
+	if (bench("slice-by-8", crc32_slice8, buf, len) != ref)
+		failed++;
+	if (bench(crc32_method(), crc32_update, buf, len) != ref)
+		failed++;
+
+	/* odd lengths and misaligned starts exercise head and tail handling */
+	for (i = 0; i < 300; i++) {
+		if (crc32_update(0xffffffff, buf + i % 7, i) !=
+		    crc32_bytewise(0xffffffff, buf + i % 7, i))
+			failed++;
+	}
+
+	/* chunks computed independently from 0, combined in order */
+	chunk = len / BENCH_CHUNKS + 1;
+	crc = 0xffffffff;
+	for (i = 0; i < len; i += chunk) {
+		size_t n = len - i < chunk ? len - i : chunk;
+
+		crc = crc32_combine(crc, crc32_update(0, buf + i, n), n);
+	}
+	if (crc != ref)
+		failed++;
+	printf("combined     %08x\n", crc);
+
+	free(buf);
+	if (failed) {
+		printf("%i mismatches\n", failed);
+		return EX_SOFTWARE;
+	}
+	return EX_OK;
+}
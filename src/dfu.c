@@ -28,10 +28,113 @@
 
 #include "portable.h"
 #include "dfu.h"
+#include "dfu_file.h"
 #include "quirks.h"
 
 static int dfu_timeout = 5000;  /* 5 seconds - default */
 
+/* Poll by learned busy times instead of the reported bwPollTimeout */
+int dfu_adaptive_poll = 0;
+
+/* Per request class statistics for adaptive polling */
+static struct {
+    unsigned int count;
+    unsigned int estimate;      /* learned busy time in ms */
+    unsigned long long busy;    /* total busy time observed */
+    unsigned long long blind;   /* total time with bwPollTimeout sleeps */
+} dfu_poll_stats[DFU_OP_COUNT];
+
+static const char *dfu_poll_op_names[DFU_OP_COUNT] = {
+    "write", "set address", "page erase", "mass erase"
+};
+
+static int libusb_transport_control( libusb_device_handle *device,
+                                     uint8_t request_type, uint8_t request,
+                                     uint16_t value, uint16_t index,
+                                     unsigned char *data, uint16_t length,
+                                     unsigned int timeout )
+{
+    return libusb_control_transfer( device, request_type, request, value,
+                                    index, data, length, timeout );
+}
+
+static int libusb_transport_claim( libusb_device_handle *device,
+                                   int interface )
+{
+    return libusb_claim_interface( device, interface );
+}
+
+static int libusb_transport_release( libusb_device_handle *device,
+                                     int interface )
+{
+    return libusb_release_interface( device, interface );
+}
+
+static int libusb_transport_set_alt( libusb_device_handle *device,
+                                     int interface, int alt )
+{
+    return libusb_set_interface_alt_setting( device, interface, alt );
+}
+
+static int libusb_transport_reset( libusb_device_handle *device )
+{
+    return libusb_reset_device( device );
+}
+
+static void libusb_transport_close( libusb_device_handle *device )
+{
+    libusb_close( device );
+}
+
+/* Reads the name of an alternate setting of the DFU interface from the
+ * configuration descriptor, probing only reads the selected one */
+static int libusb_transport_get_alt_name( struct dfu_if *dif, int alt,
+                                          char *name, int size )
+{
+    struct libusb_config_descriptor *cfg;
+    int index = 0;
+    int i;
+    int j;
+    int ret;
+
+    if (libusb_get_active_config_descriptor(dif->dev, &cfg) < 0)
+        return -1;
+    for (i = 0; i < cfg->bNumInterfaces; i++) {
+        const struct libusb_interface *intf = &cfg->interface[i];
+
+        for (j = 0; j < intf->num_altsetting; j++) {
+            const struct libusb_interface_descriptor *desc =
+                &intf->altsetting[j];
+
+            if (desc->bInterfaceNumber == dif->interface &&
+                desc->bAlternateSetting == alt)
+                index = desc->iInterface;
+        }
+    }
+    libusb_free_config_descriptor(cfg);
+    if (index == 0)
+        return -1;
+    ret = libusb_get_string_descriptor_ascii(dif->dev_handle, index,
+                                             (void *)name, size - 1);
+    if (ret < 0)
+        return -1;
+    name[ret] = 0;
+    return 0;
+}
+
+const struct dfu_transport dfu_libusb_transport = {
+    libusb_transport_control,
+    libusb_transport_claim,
+    libusb_transport_release,
+    libusb_transport_set_alt,
+    libusb_transport_reset,
+    libusb_transport_close,
+    libusb_transport_get_alt_name
+};
+
+/* Transport for all requests, see dfu_emu.c for the alternative */
+const struct dfu_transport *dfu_transport = &dfu_libusb_transport;
+
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
  *
@@ -46,7 +149,7 @@ int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout )
 {
-    return libusb_control_transfer( device,
+    return dfu_transport->control( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_DETACH,
         /* wValue        */ timeout,
@@ -76,7 +179,7 @@ int dfu_download( libusb_device_handle *device,
 {
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dfu_transport->control( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DNLOAD,
           /* wValue        */ transaction,
@@ -107,7 +210,7 @@ int dfu_upload( libusb_device_handle *device,
 {
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dfu_transport->control( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_UPLOAD,
           /* wValue        */ transaction,
@@ -139,7 +242,7 @@ int dfu_get_status( struct dfu_if *dif, struct dfu_status *status )
     status->bState        = STATE_DFU_ERROR;
     status->iString       = 0;
 
-    result = libusb_control_transfer( dif->dev_handle,
+    result = dfu_transport->control( dif->dev_handle,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATUS,
           /* wValue        */ 0,
@@ -148,22 +251,35 @@ int dfu_get_status( struct dfu_if *dif, struct dfu_status *status )
           /* wLength       */ 6,
                               dfu_timeout );
 
-    if( 6 == result ) {
-        status->bStatus = buffer[0];
-        if (dif->quirks & QUIRK_POLLTIMEOUT)
-            status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
-        else
-            status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
-                                    ((0xff & buffer[2]) << 8)  |
-                                    (0xff & buffer[1]);
-        status->bState  = buffer[4];
-        status->iString = buffer[5];
-    }
+    if( 6 == result )
+        dfu_decode_status( dif, buffer, status );
 
     return result;
 }
 
 
+/*
+ *  Decode the 6-byte DFU_GETSTATUS response
+ *
+ *  dif       - the interface the response was received from (for quirks)
+ *  buffer    - the raw response data
+ *  status    - the data structure to be populated with the results
+ */
+void dfu_decode_status( struct dfu_if *dif, const unsigned char *buffer,
+                        struct dfu_status *status )
+{
+    status->bStatus = buffer[0];
+    if (dif->quirks & QUIRK_POLLTIMEOUT)
+        status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
+    else
+        status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
+                                ((0xff & buffer[2]) << 8)  |
+                                (0xff & buffer[1]);
+    status->bState  = buffer[4];
+    status->iString = buffer[5];
+}
+
+
 /*
  *  DFU_CLRSTATUS Request (DFU Spec 1.0, Section 6.1.3)
  *
@@ -175,7 +291,7 @@ int dfu_get_status( struct dfu_if *dif, struct dfu_status *status )
 int dfu_clear_status( libusb_device_handle *device,
                       const unsigned short interface )
 {
-    return libusb_control_transfer( device,
+    return dfu_transport->control( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_CLRSTATUS,
         /* wValue        */ 0,
@@ -203,7 +319,7 @@ int dfu_get_state( libusb_device_handle *device,
     int result;
     unsigned char buffer[1];
 
-    result = libusb_control_transfer( device,
+    result = dfu_transport->control( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATE,
           /* wValue        */ 0,
@@ -232,7 +348,7 @@ int dfu_get_state( libusb_device_handle *device,
 int dfu_abort( libusb_device_handle *device,
                const unsigned short interface )
 {
-    return libusb_control_transfer( device,
+    return dfu_transport->control( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_ABORT,
         /* wValue        */ 0,
@@ -243,6 +359,119 @@ int dfu_abort( libusb_device_handle *device,
 }
 
 
+/*
+ *  Start status polling for a request that has just been sent
+ *
+ *  poll      - polling state to initialize
+ *  op        - the class of request, busy times are learned per class
+ */
+void dfu_poll_start( struct dfu_poll *poll, enum dfu_poll_op op )
+{
+    poll->op = op;
+    poll->start = dfu_time_ms();
+    poll->step = 0;
+    poll->device_wait = 0;
+    poll->polls = 0;
+}
+
+
+/*
+ *  Decide how long to wait before the next DFU_GETSTATUS poll
+ *
+ *  poll      - polling state from dfu_poll_start()
+ *  status    - the status just received from the device
+ *
+ *  Without adaptive polling this is always the reported bwPollTimeout.
+ *  Otherwise, the first wait aims slightly below the busy time learned
+ *  for earlier requests of the same class, followed by a doubling
+ *  backoff. No single wait is longer than the device asked for. Once
+ *  the device is no longer busy the request is accounted for and 0 is
+ *  returned.
+ *
+ *  returns the time to wait in milliseconds
+ */
+unsigned int dfu_poll_next( struct dfu_poll *poll,
+                            const struct dfu_status *status )
+{
+    unsigned long long elapsed = dfu_time_ms() - poll->start;
+    unsigned int timeout = status->bwPollTimeout;
+    unsigned int wait;
+    unsigned long long blind;
+
+    if (poll->polls++ == 0)
+        poll->device_wait = timeout;
+
+    if (status->bState != DFU_STATE_dfuDNBUSY &&
+        status->bState != DFU_STATE_dfuDNLOAD_SYNC) {
+        /* Done, learn how long it really took */
+        blind = poll->device_wait;
+        if (blind && elapsed > blind)
+            blind *= (elapsed + blind - 1) / blind;
+        dfu_poll_stats[poll->op].busy += elapsed;
+        dfu_poll_stats[poll->op].blind += blind;
+        if (dfu_poll_stats[poll->op].count++ == 0)
+            dfu_poll_stats[poll->op].estimate = elapsed;
+        else
+            dfu_poll_stats[poll->op].estimate =
+                (3 * dfu_poll_stats[poll->op].estimate + elapsed) / 4;
+        return dfu_adaptive_poll ? 0 : timeout;
+    }
+
+    if (!dfu_adaptive_poll)
+        return timeout;
+
+    if (poll->step == 0) {
+        unsigned int target = 0;
+
+        if (dfu_poll_stats[poll->op].count) {
+            target = dfu_poll_stats[poll->op].estimate;
+            poll->step = target / 8;
+            target -= poll->step;
+        } else {
+            poll->step = timeout / 8;
+        }
+        if (poll->step == 0)
+            poll->step = 1;
+        if (target > elapsed)
+            wait = target - elapsed;
+        else
+            wait = poll->step;
+    } else {
+        poll->step *= 2;
+        wait = poll->step;
+    }
+    if (wait > timeout)
+        wait = timeout;
+    if (verbose > 1)
+        printf("   Adaptive poll in %u ms (device asked for %u ms)\n",
+               wait, timeout);
+    return wait;
+}
+
+
+/* Print the time adaptive polling saved per request class */
+void dfu_poll_report( void )
+{
+    int op;
+
+    if (!dfu_adaptive_poll)
+        return;
+
+    for (op = 0; op != DFU_OP_COUNT; op++) {
+        unsigned long long saved = 0;
+
+        if (!dfu_poll_stats[op].count)
+            continue;
+        if (dfu_poll_stats[op].blind > dfu_poll_stats[op].busy)
+            saved = dfu_poll_stats[op].blind - dfu_poll_stats[op].busy;
+        printf("Adaptive polling: %u %s requests, %llu ms average, "
+               "%llu ms saved\n", dfu_poll_stats[op].count,
+               dfu_poll_op_names[op],
+               dfu_poll_stats[op].busy / dfu_poll_stats[op].count, saved);
+    }
+}
+
+
 const char* dfu_state_to_string( int state )
 {
     const char *message;
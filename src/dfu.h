@@ -83,6 +83,24 @@ struct dfu_status {
     unsigned char iString;
 };
 
+/* Request classes for adaptive DFU_GETSTATUS polling */
+enum dfu_poll_op {
+    DFU_OP_WRITE,
+    DFU_OP_SET_ADDRESS,
+    DFU_OP_ERASE_PAGE,
+    DFU_OP_MASS_ERASE,
+    DFU_OP_COUNT
+};
+
+/* State of the status polling for one request */
+struct dfu_poll {
+    enum dfu_poll_op op;
+    unsigned long long start;
+    unsigned int step;
+    unsigned int device_wait;
+    int polls;
+};
+
 struct dfu_if {
     struct usb_dfu_func_descriptor func_dfu;
     uint16_t quirks;
@@ -103,6 +121,25 @@ struct dfu_if {
     struct dfu_if *next;
 };
 
+/* How requests reach a device: libusb, or an emulated device whose
+ * state hides behind the device handle */
+struct dfu_transport {
+    int (*control)( libusb_device_handle *device, uint8_t request_type,
+                    uint8_t request, uint16_t value, uint16_t index,
+                    unsigned char *data, uint16_t length,
+                    unsigned int timeout );
+    int (*claim_interface)( libusb_device_handle *device, int interface );
+    int (*release_interface)( libusb_device_handle *device, int interface );
+    int (*set_alt)( libusb_device_handle *device, int interface, int alt );
+    int (*reset)( libusb_device_handle *device );
+    void (*close)( libusb_device_handle *device );
+    int (*get_alt_name)( struct dfu_if *dif, int alt, char *name,
+                         int size );
+};
+
+extern const struct dfu_transport dfu_libusb_transport;
+extern const struct dfu_transport *dfu_transport;
+
 int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout );
@@ -118,6 +155,9 @@ int dfu_upload( libusb_device_handle *device,
                 unsigned char* data );
 int dfu_get_status( struct dfu_if *dif,
                     struct dfu_status *status );
+void dfu_decode_status( struct dfu_if *dif,
+                        const unsigned char *buffer,
+                        struct dfu_status *status );
 int dfu_clear_status( libusb_device_handle *device,
                       const unsigned short interface );
 int dfu_get_state( libusb_device_handle *device,
@@ -126,6 +166,13 @@ int dfu_abort( libusb_device_handle *device,
                const unsigned short interface );
 int dfu_abort_to_idle( struct dfu_if *dif);
 
+extern int dfu_adaptive_poll;
+
+void dfu_poll_start( struct dfu_poll *poll, enum dfu_poll_op op );
+unsigned int dfu_poll_next( struct dfu_poll *poll,
+                            const struct dfu_status *status );
+void dfu_poll_report( void );
+
 const char *dfu_state_to_string( int state );
 
 const char *dfu_status_to_string( int status );
@@ -0,0 +1,291 @@
+/*
+ * Asynchronous (pipelined) DFU download engine
+ *
+ * The synchronous download loops send a DFU_DNLOAD, poll DFU_GETSTATUS
+ * until the device is idle again and only then prepare the next request,
+ * leaving the bus idle for a host round trip per chunk. This engine uses
+ * the libusb asynchronous API instead: the next DNLOAD request is staged
+ * in a second transfer while the device is busy, and is submitted from
+ * the GETSTATUS completion callback as soon as dfuDNLOAD-IDLE is seen.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "dfu_file.h"
+#include "dfu_async.h"
+
+#define DFU_TIMEOUT 5000
+
+libusb_context *dfu_async_ctx = NULL;
+
+struct dfu_pipe {
+	struct dfu_if *dif;
+	int xfer_size;
+	/* double-buffered DNLOAD requests */
+	struct libusb_transfer *dnload[2];
+	struct libusb_transfer *getstatus;
+	unsigned char status_buf[LIBUSB_CONTROL_SETUP_SIZE + 6];
+	int next;		/* DNLOAD transfer to fill next */
+	int staged;		/* DNLOAD transfer waiting for the device, or -1 */
+	int busy;		/* a request or its status polling is ongoing */
+	int in_flight;		/* number of submitted libusb transfers */
+	int error;
+	enum dfu_poll_op op[2];		/* request class of each transfer */
+	struct dfu_poll poll;
+	unsigned long long poll_at;	/* when to send the next GETSTATUS */
+	struct dfu_status dst;
+};
+
+static void dfu_pipe_fail(struct dfu_pipe *pipe, int error)
+{
+	if (!pipe->error)
+		pipe->error = error;
+	pipe->busy = 0;
+	pipe->staged = -1;
+	pipe->poll_at = 0;
+}
+
+static void dfu_pipe_submit(struct dfu_pipe *pipe,
+			    struct libusb_transfer *transfer)
+{
+	int ret;
+
+	ret = libusb_submit_transfer(transfer);
+	if (ret < 0) {
+		warnx("Cannot submit asynchronous transfer: %s",
+		      libusb_error_name(ret));
+		dfu_pipe_fail(pipe, ret);
+		return;
+	}
+	pipe->in_flight++;
+}
+
+static void LIBUSB_CALL dfu_pipe_dnload_cb(struct libusb_transfer *transfer)
+{
+	struct dfu_pipe *pipe = transfer->user_data;
+
+	pipe->in_flight--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		warnx("Asynchronous DFU_DNLOAD failed (transfer status %d)",
+		      transfer->status);
+		dfu_pipe_fail(pipe, LIBUSB_ERROR_IO);
+		return;
+	}
+	dfu_poll_start(&pipe->poll,
+		       pipe->op[transfer == pipe->dnload[0] ? 0 : 1]);
+	/* ask for the status right away, as the synchronous path does */
+	dfu_pipe_submit(pipe, pipe->getstatus);
+}
+
+static void LIBUSB_CALL dfu_pipe_status_cb(struct libusb_transfer *transfer)
+{
+	struct dfu_pipe *pipe = transfer->user_data;
+	struct dfu_status *dst = &pipe->dst;
+	unsigned int wait;
+	int idx;
+
+	pipe->in_flight--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	    transfer->actual_length != 6) {
+		warnx("Asynchronous DFU_GETSTATUS failed (transfer status %d)",
+		      transfer->status);
+		dfu_pipe_fail(pipe, LIBUSB_ERROR_IO);
+		return;
+	}
+	dfu_decode_status(pipe->dif, libusb_control_transfer_get_data(transfer),
+			  dst);
+	wait = dfu_poll_next(&pipe->poll, dst);
+
+	if (dst->bState != DFU_STATE_dfuDNLOAD_IDLE &&
+	    dst->bState != DFU_STATE_dfuERROR &&
+	    dst->bState != DFU_STATE_dfuMANIFEST) {
+		/* Poll again once the device has executed the request */
+		pipe->poll_at = dfu_time_ms() + wait;
+		return;
+	}
+
+	if (dst->bStatus != DFU_STATUS_OK) {
+		printf(" failed!\n");
+		printf("state(%u) = %s, status(%u) = %s\n", dst->bState,
+		       dfu_state_to_string(dst->bState), dst->bStatus,
+		       dfu_status_to_string(dst->bStatus));
+		dfu_pipe_fail(pipe, -1);
+		return;
+	}
+
+	if (pipe->staged < 0) {
+		pipe->busy = 0;
+		return;
+	}
+	/* Device is ready, send the staged request without delay */
+	idx = pipe->staged;
+	pipe->staged = -1;
+	dfu_pipe_submit(pipe, pipe->dnload[idx]);
+}
+
+/* Run the event loop until the pipe is idle (or has a free DNLOAD
+ * transfer if drain is zero), sending delayed GETSTATUS polls when due */
+static void dfu_pipe_run(struct dfu_pipe *pipe, int drain)
+{
+	while (!pipe->error && (drain ? pipe->busy : pipe->staged >= 0)) {
+		unsigned long long wait = DFU_TIMEOUT;
+		struct timeval tv;
+		int ret;
+
+		if (pipe->poll_at) {
+			unsigned long long now = dfu_time_ms();
+
+			if (now >= pipe->poll_at) {
+				pipe->poll_at = 0;
+				dfu_pipe_submit(pipe, pipe->getstatus);
+				continue;
+			}
+			wait = pipe->poll_at - now;
+		}
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		ret = libusb_handle_events_timeout_completed(dfu_async_ctx,
+							     &tv, NULL);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			warnx("Error handling USB events: %s",
+			      libusb_error_name(ret));
+			dfu_pipe_fail(pipe, ret);
+		}
+	}
+}
+
+/* Returns NULL if asynchronous transfers are not enabled */
+struct dfu_pipe *dfu_pipe_open(struct dfu_if *dif, int xfer_size)
+{
+	struct dfu_pipe *pipe;
+	int i;
+
+	if (!dfu_async_ctx)
+		return NULL;
+
+	pipe = dfu_malloc(sizeof(*pipe));
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->dif = dif;
+	pipe->xfer_size = xfer_size;
+	pipe->staged = -1;
+
+	for (i = 0; i < 2; i++) {
+		pipe->dnload[i] = libusb_alloc_transfer(0);
+		if (!pipe->dnload[i])
+			errx(EX_SOFTWARE, "Cannot allocate USB transfer");
+		pipe->dnload[i]->buffer =
+		    dfu_malloc(LIBUSB_CONTROL_SETUP_SIZE + xfer_size);
+	}
+
+	pipe->getstatus = libusb_alloc_transfer(0);
+	if (!pipe->getstatus)
+		errx(EX_SOFTWARE, "Cannot allocate USB transfer");
+	libusb_fill_control_setup(pipe->status_buf,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
+		LIBUSB_RECIPIENT_INTERFACE, DFU_GETSTATUS, 0,
+		dif->interface, 6);
+	libusb_fill_control_transfer(pipe->getstatus, dif->dev_handle,
+		pipe->status_buf, dfu_pipe_status_cb, pipe, DFU_TIMEOUT);
+
+	if (verbose)
+		printf("Using asynchronous transfers\n");
+	return pipe;
+}
+
+/* Queues a DNLOAD request of up to xfer_size bytes. The data is copied,
+ * so the caller may reuse its buffer as soon as this returns. An error
+ * from a previously queued request can be reported by a later call.
+ * Returns the number of bytes queued or < 0 on error */
+int dfu_pipe_dnload(struct dfu_pipe *pipe, enum dfu_poll_op op,
+		    unsigned short transaction,
+		    const unsigned char *data, int length)
+{
+	struct libusb_transfer *transfer;
+	int idx;
+
+	if (length > pipe->xfer_size)
+		errx(EX_SOFTWARE, "Request too large for transfer buffer");
+
+	/* both transfers in use, wait until the staged one has been sent */
+	dfu_pipe_run(pipe, 0);
+	if (pipe->error)
+		return pipe->error;
+
+	idx = pipe->next;
+	pipe->next ^= 1;
+	transfer = pipe->dnload[idx];
+	pipe->op[idx] = op;
+
+	libusb_fill_control_setup(transfer->buffer,
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
+		LIBUSB_RECIPIENT_INTERFACE, DFU_DNLOAD, transaction,
+		pipe->dif->interface, length);
+	if (length)
+		memcpy(transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data,
+		       length);
+	libusb_fill_control_transfer(transfer, pipe->dif->dev_handle,
+		transfer->buffer, dfu_pipe_dnload_cb, pipe, DFU_TIMEOUT);
+
+	if (pipe->busy) {
+		pipe->staged = idx;
+	} else {
+		pipe->busy = 1;
+		dfu_pipe_submit(pipe, transfer);
+	}
+	return pipe->error ? pipe->error : length;
+}
+
+/* Waits until all queued requests have been executed by the device.
+ * Returns 0 or < 0 on error, the last status is stored in dst if given */
+int dfu_pipe_flush(struct dfu_pipe *pipe, struct dfu_status *dst)
+{
+	dfu_pipe_run(pipe, 1);
+	if (dst)
+		*dst = pipe->dst;
+	return pipe->error;
+}
+
+void dfu_pipe_close(struct dfu_pipe *pipe)
+{
+	int i;
+
+	if (!pipe)
+		return;
+
+	/* reap anything still in flight after an error */
+	while (pipe->in_flight > 0) {
+		libusb_cancel_transfer(pipe->dnload[0]);
+		libusb_cancel_transfer(pipe->dnload[1]);
+		libusb_cancel_transfer(pipe->getstatus);
+		if (libusb_handle_events(dfu_async_ctx) < 0)
+			break;
+	}
+
+	for (i = 0; i < 2; i++) {
+		free(pipe->dnload[i]->buffer);
+		libusb_free_transfer(pipe->dnload[i]);
+	}
+	libusb_free_transfer(pipe->getstatus);
+	free(pipe);
+}
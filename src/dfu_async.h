@@ -0,0 +1,37 @@
+/*
+ * Asynchronous (pipelined) DFU download engine
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_ASYNC_H
+#define DFU_ASYNC_H
+
+#include <libusb.h>
+#include "dfu.h"
+
+/* Set by main() when asynchronous transfers are requested, NULL otherwise */
+extern libusb_context *dfu_async_ctx;
+
+struct dfu_pipe;
+
+struct dfu_pipe *dfu_pipe_open(struct dfu_if *dif, int xfer_size);
+int dfu_pipe_dnload(struct dfu_pipe *pipe, enum dfu_poll_op op,
+		    unsigned short transaction,
+		    const unsigned char *data, int length);
+int dfu_pipe_flush(struct dfu_pipe *pipe, struct dfu_status *dst);
+void dfu_pipe_close(struct dfu_pipe *pipe);
+
+#endif /* DFU_ASYNC_H */
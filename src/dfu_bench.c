@@ -0,0 +1,334 @@
+/*
+ * Transfer benchmark over emulated devices
+ *
+ * Runs plain DFU and DfuSe downloads and uploads of a synthetic image
+ * against the devices of dfu_emu.c, at several transfer sizes and with
+ * several fractions of blank flash, and prints one tab separated line
+ * per workload: throughput, control requests by type, status polls and
+ * the host's idle time between requests. Manifestation after a download
+ * is timed in a column of its own and left out of the throughput, as it
+ * is mostly a fixed wait. Every workload runs in a child process of its
+ * own, as the transfer code keeps its options in static variables. A
+ * workload whose transfer fails or that writes flash that was not
+ * erased makes the run exit non-zero.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_load.h"
+#include "dfu_emu.h"
+#include "dfuse.h"
+
+#ifdef HAVE_FORK
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+int verbose = 0;
+
+enum bench_kind {
+	BENCH_DFU_DNLOAD,
+	BENCH_DFU_UPLOAD,
+	BENCH_DFUSE_RAW,
+	BENCH_DFUSE_FILE,
+	BENCH_DFUSE_UPLOAD
+};
+
+struct bench_workload {
+	const char *name;
+	const char *device;	/* emulated device, see dfu_emu_help() */
+	enum bench_kind kind;
+	unsigned int xfer;
+	int sparsity;		/* percent of blank KiB in the image */
+};
+
+static const struct bench_workload bench_workloads[] = {
+	{ "dfu-dnload", "dfu", BENCH_DFU_DNLOAD, 256, 0 },
+	{ "dfu-dnload", "dfu", BENCH_DFU_DNLOAD, 1024, 0 },
+	{ "dfu-dnload", "dfu", BENCH_DFU_DNLOAD, 4096, 0 },
+	{ "dfu-upload", "dfu", BENCH_DFU_UPLOAD, 1024, 0 },
+	{ "dfu-upload", "dfu", BENCH_DFU_UPLOAD, 4096, 0 },
+	{ "dfuse-raw", "gd32vf103cb", BENCH_DFUSE_RAW, 512, 0 },
+	{ "dfuse-raw", "gd32vf103cb", BENCH_DFUSE_RAW, 1024, 0 },
+	{ "dfuse-raw", "gd32vf103cb", BENCH_DFUSE_RAW, 2048, 0 },
+	{ "dfuse-raw", "gd32vf103cb", BENCH_DFUSE_RAW, 2048, 50 },
+	{ "dfuse-raw", "gd32vf103cb", BENCH_DFUSE_RAW, 2048, 90 },
+	{ "dfuse-file", "gd32vf103cb", BENCH_DFUSE_FILE, 2048, 0 },
+	{ "dfuse-file", "gd32vf103cb", BENCH_DFUSE_FILE, 2048, 50 },
+	{ "dfuse-upload", "gd32vf103cb", BENCH_DFUSE_UPLOAD, 512, 0 },
+	{ "dfuse-upload", "gd32vf103cb", BENCH_DFUSE_UPLOAD, 2048, 0 },
+};
+
+#define BENCH_FLASH	0x08000000
+#define BENCH_OPTIONS	0x1ffff800
+#define BENCH_ELEMENTS	4
+
+struct bench_result {
+	unsigned long long bytes;
+	unsigned long long ms;
+	struct dfu_emu_stats stats;
+};
+
+/* Pseudo-random image in which sparsity percent of the KiB are blank */
+static unsigned char *bench_image(unsigned int size, int sparsity)
+{
+	unsigned char *buf = dfu_malloc(size);
+	uint32_t seed = 1;
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+		if ((i / 1024) % 10 < (unsigned int)sparsity / 10)
+			buf[i] = 0xff;
+	}
+	return buf;
+}
+
+static unsigned char *bench_put32(unsigned char *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+	return p + 4;
+}
+
+static unsigned char *bench_target(unsigned char *p, int alt,
+				   uint32_t size, int elements)
+{
+	memset(p, 0, 274);
+	memcpy(p, "Target", 6);
+	p[6] = alt;
+	bench_put32(p + 266, size);
+	bench_put32(p + 270, elements);
+	return p + 274;
+}
+
+/*
+ * Builds a DfuSe file of the image split into elements with gaps of a
+ * page between them, and a second target for the option bytes
+ */
+static void bench_dfuse_file(struct dfu_file *file, unsigned char *image,
+			     unsigned int size)
+{
+	unsigned int chunk = size / BENCH_ELEMENTS;
+	unsigned int total = 11 + 274 + BENCH_ELEMENTS * (8 + chunk) +
+	    274 + 8 + 16;
+	unsigned char *buf = dfu_malloc(total);
+	unsigned char *p = buf;
+	int i;
+
+	memcpy(p, "DfuSe\x01", 6);
+	bench_put32(p + 6, total);
+	p[10] = 2;
+	p = bench_target(p + 11, 0, BENCH_ELEMENTS * (8 + chunk),
+			 BENCH_ELEMENTS);
+	for (i = 0; i < BENCH_ELEMENTS; i++) {
+		p = bench_put32(p, BENCH_FLASH + i * (chunk + 1024));
+		p = bench_put32(p, chunk);
+		memcpy(p, image + i * chunk, chunk);
+		p += chunk;
+	}
+	p = bench_target(p, 1, 8 + 16, 1);
+	p = bench_put32(p, BENCH_OPTIONS);
+	p = bench_put32(p, 16);
+	memset(p, 0x5a, 16);
+
+	file->firmware = buf;
+	file->size.total = total;
+	file->bcdDFU = 0x11a;
+}
+
+/* Returns 0 if the transfer succeeded and programmed every page intact */
+static int bench_run(const struct bench_workload *w, unsigned int size,
+		     struct bench_result *result)
+{
+	struct dfu_file file;
+	struct dfu_if *dif;
+	unsigned long long start;
+	char spec[64];
+	char options[32];
+	int ret = 0;
+	int fd;
+
+	/* a plain DFU device holds exactly the image */
+	if (w->kind == BENCH_DFU_DNLOAD || w->kind == BENCH_DFU_UPLOAD)
+		snprintf(spec, sizeof(spec), "%s:xfer=%u:size=%u", w->device,
+			 w->xfer, size);
+	else
+		snprintf(spec, sizeof(spec), "%s:xfer=%u", w->device,
+			 w->xfer);
+	dif = dfu_emu_open(spec, 0, NULL);
+	dfu_transport->set_alt(dif->dev_handle, dif->interface,
+			       dif->altsetting);
+
+	memset(&file, 0, sizeof(file));
+	file.firmware = bench_image(size, w->sparsity);
+	file.size.total = size;
+	file.idVendor = 0xffff;
+	file.idProduct = 0xffff;
+	file.bcdDevice = 0xffff;
+	result->bytes = size;
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		err(EX_IOERR, "Cannot open /dev/null");
+
+	start = dfu_time_ms();
+	switch (w->kind) {
+	case BENCH_DFU_DNLOAD:
+		ret = dfuload_do_dnload(dif, w->xfer, &file);
+		break;
+	case BENCH_DFU_UPLOAD:
+		ret = dfuload_do_upload(dif, w->xfer, size, fd);
+		break;
+	case BENCH_DFUSE_RAW:
+		snprintf(options, sizeof(options), "0x%08x", BENCH_FLASH);
+		ret = dfuse_do_dnload(dif, w->xfer, &file, options);
+		break;
+	case BENCH_DFUSE_FILE:
+		bench_dfuse_file(&file, file.firmware, size);
+		result->bytes = size / BENCH_ELEMENTS * BENCH_ELEMENTS + 16;
+		ret = dfuse_do_dnload(dif, w->xfer, &file, NULL);
+		break;
+	case BENCH_DFUSE_UPLOAD:
+		snprintf(options, sizeof(options), "0x%08x:%u", BENCH_FLASH,
+			 size);
+		ret = dfuse_do_upload(dif, w->xfer, fd, options);
+		break;
+	}
+	result->stats = *dfu_emu_get_stats(dif);
+	result->ms = dfu_time_ms() - start - result->stats.manifest_us / 1000;
+	close(fd);
+	return ret < 0 || result->stats.program_errors ? -1 : 0;
+}
+
+#ifdef HAVE_FORK
+/*
+ * Runs a workload in a child with its output silenced. Returns -1 if
+ * no result came back, 1 if the workload failed and 0 otherwise.
+ */
+static int bench_child(const struct bench_workload *w, unsigned int size,
+		       struct bench_result *result)
+{
+	int pipefd[2];
+	int status;
+	pid_t pid;
+	int ret;
+	int n;
+
+	if (pipe(pipefd) < 0)
+		err(EX_IOERR, "Cannot create pipe");
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		err(EX_IOERR, "Cannot fork");
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		close(pipefd[0]);
+		if (!verbose && null >= 0)
+			dup2(null, 1);
+		ret = bench_run(w, size, result);
+		fflush(stdout);
+		if (write(pipefd[1], result, sizeof(*result)) !=
+		    sizeof(*result))
+			_exit(EX_IOERR);
+		_exit(ret ? EX_SOFTWARE : EX_OK);
+	}
+	close(pipefd[1]);
+	n = read(pipefd[0], result, sizeof(*result));
+	close(pipefd[0]);
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			err(EX_SOFTWARE, "Cannot wait for workload");
+	}
+	if (n != sizeof(*result))
+		return -1;
+	return !WIFEXITED(status) || WEXITSTATUS(status) != EX_OK;
+}
+#endif /* HAVE_FORK */
+
+int main(int argc, char **argv)
+{
+	unsigned int size = 32 * 1024;
+	int failed = 0;
+	unsigned int i;
+
+	for (i = 1; i < (unsigned int)argc; i++) {
+		if (!strcmp(argv[i], "-v")) {
+			verbose++;
+		} else {
+			size = strtoul(argv[i], NULL, 0) * 1024;
+			/* the DfuSe file must fit the 128 KiB of flash */
+			if (!size || size > 96 * 1024)
+				errx(EX_USAGE, "Usage: %s [-v] [KiB, up to 96]",
+				     argv[0]);
+		}
+	}
+
+	printf("# workload\txfer\tsparsity\tbytes\tms\tbytes_per_s"
+	       "\tmanifest_ms"
+	       "\tdetach\tdnload\tupload\tgetstatus\tclrstatus\tgetstate"
+	       "\tabort\tbusy_polls\tidle_ms\tpages_erased"
+	       "\tprogram_errors\n");
+	for (i = 0; i < sizeof(bench_workloads) /
+	     sizeof(bench_workloads[0]); i++) {
+		const struct bench_workload *w = &bench_workloads[i];
+		struct bench_result r;
+		const unsigned int *req = r.stats.requests;
+		int ret;
+
+		memset(&r, 0, sizeof(r));
+#ifdef HAVE_FORK
+		ret = bench_child(w, size, &r);
+#else
+		if (i > 0)
+			errx(EX_SOFTWARE, "Without fork() only the first "
+			     "workload can be run");
+		ret = bench_run(w, size, &r) ? 1 : 0;
+#endif
+		if (ret) {
+			warnx("Workload %s at %u bytes failed", w->name,
+			      w->xfer);
+			failed++;
+			/* a failed transfer still reports what it did */
+			if (ret < 0)
+				continue;
+		}
+		printf("%s\t%u\t%i\t%llu\t%llu\t%llu\t%llu"
+		       "\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%llu\t%u\t%u\n",
+		       w->name, w->xfer, w->sparsity, r.bytes, r.ms,
+		       r.bytes * 1000 / (r.ms ? r.ms : 1),
+		       r.stats.manifest_us / 1000,
+		       req[DFU_DETACH], req[DFU_DNLOAD], req[DFU_UPLOAD],
+		       req[DFU_GETSTATUS], req[DFU_CLRSTATUS],
+		       req[DFU_GETSTATE], req[DFU_ABORT],
+		       r.stats.busy_polls, r.stats.idle_us / 1000,
+		       r.stats.pages_erased, r.stats.program_errors);
+		fflush(stdout);
+	}
+	return failed ? EX_SOFTWARE : EX_OK;
+}
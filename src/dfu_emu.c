@@ -0,0 +1,771 @@
+/*
+ * Emulated DFU and DfuSe devices
+ *
+ * An emulated device sits behind the request transport instead of
+ * libusb, so that the transfer code can be run and timed without
+ * hardware. It implements the DFU 1.1 state machine and the DfuSe
+ * commands, with flash memory that must be erased before it is
+ * written, and takes as long for every operation as its profile says.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_emu.h"
+#include "dfuse_mem.h"
+#include "quirks.h"
+
+#define EMU_MAX_ALTS 4
+
+/* A device model. Write and erase times are per KiB, all times in ms
+ * except for the USB round trip */
+struct dfu_emu_profile {
+	const char *name;
+	const char *description;
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t bcdDFU;
+	uint16_t transfer_size;
+	uint8_t attributes;
+	const char *serial;
+	const char *alt_names[EMU_MAX_ALTS];
+	unsigned int image_size;	/* memory of a plain DFU device */
+	unsigned int usb_us;		/* added to every request */
+	unsigned int write_ms;
+	unsigned int erase_ms;
+	unsigned int mass_erase_ms;
+	unsigned int set_address_ms;
+	unsigned int manifest_ms;
+	int poll_ms;		/* reported bwPollTimeout, -1 for the real one */
+};
+
+/* Timings are rough figures from the data sheets */
+static const struct dfu_emu_profile dfu_emu_profiles[] = {
+	{ "gd32vf103cb", "GD32VF103CB, 128 KiB flash in 1 KiB pages",
+	  VENDOR_GIGADEVICE, PRODUCT_GD32, 0x011a, 2048,
+	  USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_WILL_DETACH,
+	  "3CBJ",
+	  /* the GD32 quirk replaces the flash descriptor */
+	  { "@Internal Flash  /0x08000000/512*002Kg",
+	    "@Option Bytes  /0x1FFFF800/01*016Be" },
+	  0, 125, 10, 30, 400, 1, 0, -1 },
+	{ "stm32f405", "STM32F405, 1 MiB flash in 16 to 128 KiB sectors",
+	  0x0483, 0xdf11, 0x011a, 2048,
+	  USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_WILL_DETACH,
+	  "",
+	  { "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg",
+	    "@Option Bytes  /0x1FFFC000/01*016Be" },
+	  0, 125, 4, 15, 8000, 1, 0, -1 },
+	{ "dfu", "DFU 1.1 device with a 256 KiB image",
+	  0x1209, 0x0001, 0x0110, 1024,
+	  USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL,
+	  "",
+	  { "Firmware" },
+	  256 * 1024, 125, 2, 0, 0, 0, 50, -1 },
+};
+
+struct dfu_emu_alt {
+	const char *name;
+	struct memlayout *layout;	/* DfuSe only */
+	unsigned char **memory;		/* one buffer per segment */
+};
+
+struct dfu_emu {
+	struct dfu_emu_profile p;
+	char *spec;			/* settings of p point into it */
+	int dfuse;
+	struct dfu_emu_alt alts[EMU_MAX_ALTS];
+	int alt_count;
+	int alt;
+	int left;			/* after leave or unprotect */
+
+	int state;
+	int status;
+	unsigned int pointer;		/* DfuSe address pointer */
+
+	/* the last download request, executed by DFU_GETSTATUS */
+	unsigned char *block;
+	int block_size;
+	int block_num;
+	unsigned long long busy_until;
+	int pending_status;
+
+	/* memory of a plain DFU device */
+	unsigned char *image;
+	unsigned int image_len;
+	unsigned int offset;
+
+	unsigned long long last_request_us;
+	unsigned long long manifest_start_us;	/* zero length download */
+	struct dfu_emu_stats stats;
+};
+
+static unsigned long long emu_time_us(void)
+{
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return dfu_time_ms() * 1000;
+#endif
+}
+
+static void emu_delay_us(unsigned int us)
+{
+#ifdef HAVE_NANOSLEEP
+	struct timespec delay = { us / 1000000, (us % 1000000) * 1000 };
+
+	if (us)
+		nanosleep(&delay, NULL);
+#else
+	milli_sleep((us + 999) / 1000);
+#endif
+}
+
+/* Time an operation on size bytes takes, at ms_per_kib */
+static unsigned int emu_time(unsigned int ms_per_kib, unsigned int size)
+{
+	return (unsigned int)(((unsigned long long)ms_per_kib * size +
+	    1023) / 1024);
+}
+
+static int emu_stall(struct dfu_emu *emu)
+{
+	emu->state = DFU_STATE_dfuERROR;
+	emu->status = DFU_STATUS_errSTALLEDPKT;
+	return LIBUSB_ERROR_PIPE;
+}
+
+static unsigned char *emu_memory(struct dfu_emu *emu, unsigned int address,
+				 struct memsegment **segment)
+{
+	struct dfu_emu_alt *alt = &emu->alts[emu->alt];
+
+	*segment = find_segment(alt->layout, address);
+	if (!*segment)
+		return NULL;
+	return alt->memory[*segment - alt->layout->segments] +
+	    (address - (*segment)->start);
+}
+
+static void emu_mass_erase(struct dfu_emu *emu)
+{
+	struct dfu_emu_alt *alt = &emu->alts[emu->alt];
+	int i;
+
+	for (i = 0; i < alt->layout->count; i++) {
+		struct memsegment *segment = &alt->layout->segments[i];
+
+		if (!(segment->memtype & DFUSE_ERASABLE))
+			continue;
+		memset(alt->memory[i], 0xff, segment->end - segment->start + 1);
+	}
+	emu->stats.mass_erases++;
+}
+
+/* Writes a block to DfuSe memory. Flash bits can only be cleared, a
+ * write that needs to set one means the page was not erased */
+static int emu_write(struct dfu_emu *emu, unsigned int address,
+		     const unsigned char *data, int size)
+{
+	int status = DFU_STATUS_OK;
+
+	while (size > 0) {
+		struct memsegment *segment;
+		unsigned char *mem;
+		int n;
+		int i;
+
+		mem = emu_memory(emu, address, &segment);
+		if (!mem)
+			return DFU_STATUS_errADDRESS;
+		if (!(segment->memtype & DFUSE_WRITEABLE))
+			return DFU_STATUS_errWRITE;
+		n = segment->end - address + 1;
+		if (n > size || n <= 0)
+			n = size;
+		if (segment->memtype & DFUSE_ERASABLE) {
+			for (i = 0; i < n; i++) {
+				if ((mem[i] & data[i]) != data[i])
+					status = DFU_STATUS_errPROG;
+				mem[i] &= data[i];
+			}
+		} else {
+			memcpy(mem, data, n);
+		}
+		address += n;
+		data += n;
+		size -= n;
+	}
+	if (status != DFU_STATUS_OK)
+		emu->stats.program_errors++;
+	return status;
+}
+
+/* Carries out the last download request, returns the time it takes */
+static unsigned int emu_execute(struct dfu_emu *emu)
+{
+	unsigned char *b = emu->block;
+	struct memsegment *segment;
+	unsigned int address;
+
+	emu->pending_status = DFU_STATUS_OK;
+	if (!emu->dfuse) {
+		if (emu->offset + emu->block_size > emu->p.image_size) {
+			emu->pending_status = DFU_STATUS_errADDRESS;
+			return 0;
+		}
+		memcpy(emu->image + emu->offset, b, emu->block_size);
+		emu->offset += emu->block_size;
+		emu->image_len = emu->offset;
+		emu->stats.bytes_written += emu->block_size;
+		return emu_time(emu->p.write_ms, emu->block_size);
+	}
+
+	if (emu->block_num >= 2) {
+		address = emu->pointer +
+		    (emu->block_num - 2) * emu->p.transfer_size;
+		emu->pending_status = emu_write(emu, address, b,
+						emu->block_size);
+		emu->stats.bytes_written += emu->block_size;
+		return emu_time(emu->p.write_ms, emu->block_size);
+	}
+
+	/* DfuSe command, checked when received */
+	address = b[1] | (b[2] << 8) | (b[3] << 16) | ((unsigned)b[4] << 24);
+	switch (b[0]) {
+	case 0x21:
+		if (!emu_memory(emu, address, &segment)) {
+			emu->pending_status = DFU_STATUS_errTARGET;
+			return 0;
+		}
+		emu->pointer = address;
+		return emu->p.set_address_ms;
+	case 0x41:
+		if (emu->block_size == 1) {
+			emu_mass_erase(emu);
+			return emu->p.mass_erase_ms;
+		}
+		if (!emu_memory(emu, address, &segment) ||
+		    !(segment->memtype & DFUSE_ERASABLE)) {
+			emu->pending_status = DFU_STATUS_errTARGET;
+			return 0;
+		}
+		address = segment_page_start(segment, address);
+		memset(emu_memory(emu, address, &segment), 0xff,
+		       segment->pagesize);
+		emu->stats.pages_erased++;
+		return emu_time(emu->p.erase_ms, segment->pagesize);
+	default:
+		/* read unprotect erases everything and resets */
+		emu_mass_erase(emu);
+		emu->left = 1;
+		return emu->p.mass_erase_ms;
+	}
+}
+
+static int emu_dnload(struct dfu_emu *emu, uint16_t value,
+		      const unsigned char *data, uint16_t length)
+{
+	if (emu->state != DFU_STATE_dfuIDLE &&
+	    emu->state != DFU_STATE_dfuDNLOAD_IDLE)
+		return emu_stall(emu);
+	if (!(emu->p.attributes & USB_DFU_CAN_DOWNLOAD) ||
+	    length > emu->p.transfer_size)
+		return emu_stall(emu);
+
+	if (length == 0) {
+		/* end of download, or DfuSe leave */
+		if (emu->state != DFU_STATE_dfuDNLOAD_IDLE)
+			return emu_stall(emu);
+		emu->state = DFU_STATE_dfuMANIFEST_SYNC;
+		emu->manifest_start_us = emu_time_us();
+		return 0;
+	}
+
+	if (emu->dfuse && value == 0) {
+		int valid = (data[0] == 0x21 && length == 5) ||
+		    (data[0] == 0x41 && (length == 5 || length == 1)) ||
+		    (data[0] == 0x92 && length == 1);
+
+		if (!valid)
+			return emu_stall(emu);
+	} else if (emu->dfuse && value == 1) {
+		return emu_stall(emu);
+	}
+
+	if (emu->state == DFU_STATE_dfuIDLE)
+		emu->offset = 0;
+	memcpy(emu->block, data, length);
+	emu->block_size = length;
+	emu->block_num = value;
+	emu->state = DFU_STATE_dfuDNLOAD_SYNC;
+	return length;
+}
+
+static int emu_upload(struct dfu_emu *emu, uint16_t value,
+		      unsigned char *data, uint16_t length)
+{
+	static const unsigned char commands[] = { 0x00, 0x21, 0x41, 0x92 };
+	int n = 0;
+
+	if (emu->state != DFU_STATE_dfuIDLE &&
+	    emu->state != DFU_STATE_dfuUPLOAD_IDLE)
+		return emu_stall(emu);
+	if (!(emu->p.attributes & USB_DFU_CAN_UPLOAD) ||
+	    length > emu->p.transfer_size)
+		return emu_stall(emu);
+
+	if (!emu->dfuse) {
+		if (emu->state == DFU_STATE_dfuIDLE)
+			emu->offset = 0;
+		n = emu->image_len - emu->offset;
+		if (n > length)
+			n = length;
+		memcpy(data, emu->image + emu->offset, n);
+		emu->offset += n;
+		emu->stats.bytes_read += n;
+		/* a short packet ends the upload */
+		emu->state = n < length ? DFU_STATE_dfuIDLE :
+		    DFU_STATE_dfuUPLOAD_IDLE;
+		return n;
+	}
+
+	if (value == 0) {
+		n = length < sizeof(commands) ? length : sizeof(commands);
+		memcpy(data, commands, n);
+	} else if (value == 1) {
+		return emu_stall(emu);
+	} else {
+		unsigned int address = emu->pointer +
+		    (value - 2) * emu->p.transfer_size;
+
+		while (n < length) {
+			struct memsegment *segment;
+			unsigned char *mem;
+			int chunk;
+
+			mem = emu_memory(emu, address + n, &segment);
+			if (!mem || !(segment->memtype & DFUSE_READABLE))
+				break;
+			chunk = segment->end - (address + n) + 1;
+			if (chunk > length - n || chunk <= 0)
+				chunk = length - n;
+			memcpy(data + n, mem, chunk);
+			n += chunk;
+		}
+		if (n == 0) {
+			emu->state = DFU_STATE_dfuERROR;
+			emu->status = DFU_STATUS_errTARGET;
+			return LIBUSB_ERROR_PIPE;
+		}
+		emu->stats.bytes_read += n;
+	}
+	emu->state = DFU_STATE_dfuUPLOAD_IDLE;
+	return n;
+}
+
+static int emu_get_status(struct dfu_emu *emu, unsigned char *data,
+			  uint16_t length)
+{
+	unsigned long long now = dfu_time_ms();
+	unsigned int poll = 0;
+	unsigned int busy;
+
+	if (length < 6)
+		return emu_stall(emu);
+
+	switch (emu->state) {
+	case DFU_STATE_dfuDNLOAD_SYNC:
+		busy = emu_execute(emu);
+		emu->busy_until = now + busy;
+		emu->state = DFU_STATE_dfuDNBUSY;
+		poll = emu->p.poll_ms >= 0 ? (unsigned int)emu->p.poll_ms :
+		    busy;
+		break;
+	case DFU_STATE_dfuDNBUSY:
+	case DFU_STATE_dfuMANIFEST:
+		if (now < emu->busy_until) {
+			emu->stats.busy_polls++;
+			poll = emu->busy_until - now;
+			break;
+		}
+		if (emu->state == DFU_STATE_dfuMANIFEST) {
+			emu->state = (emu->p.attributes & USB_DFU_MANIFEST_TOL) ?
+			    DFU_STATE_dfuIDLE :
+			    DFU_STATE_dfuMANIFEST_WAIT_RST;
+		} else if (emu->pending_status != DFU_STATUS_OK) {
+			emu->state = DFU_STATE_dfuERROR;
+			emu->status = emu->pending_status;
+		} else {
+			emu->state = DFU_STATE_dfuDNLOAD_IDLE;
+		}
+		break;
+	case DFU_STATE_dfuMANIFEST_SYNC:
+		emu->state = DFU_STATE_dfuMANIFEST;
+		if (emu->dfuse) {
+			/* the device jumps to the address pointer */
+			emu->left = 1;
+			break;
+		}
+		emu->busy_until = now + emu->p.manifest_ms;
+		poll = emu->p.poll_ms >= 0 ? (unsigned int)emu->p.poll_ms :
+		    emu->p.manifest_ms;
+		break;
+	default:
+		break;
+	}
+
+	data[0] = emu->status;
+	data[1] = poll & 0xff;
+	data[2] = (poll >> 8) & 0xff;
+	data[3] = (poll >> 16) & 0xff;
+	data[4] = emu->state;
+	data[5] = 0;
+	return 6;
+}
+
+static int emu_request(struct dfu_emu *emu, uint8_t request_type,
+		       uint8_t request, uint16_t value, uint16_t index,
+		       unsigned char *data, uint16_t length)
+{
+	if (emu->left)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if ((request_type & (3 << 5)) != LIBUSB_REQUEST_TYPE_CLASS ||
+	    index != 0 || request > DFU_ABORT)
+		return emu_stall(emu);
+	emu->stats.requests[request]++;
+
+	/* only status requests are answered while busy */
+	if ((emu->state == DFU_STATE_dfuDNBUSY ||
+	     emu->state == DFU_STATE_dfuMANIFEST) &&
+	    request != DFU_GETSTATUS && request != DFU_GETSTATE)
+		return emu_stall(emu);
+
+	switch (request) {
+	case DFU_DETACH:
+		return 0;
+	case DFU_DNLOAD:
+		return emu_dnload(emu, value, data, length);
+	case DFU_UPLOAD:
+		return emu_upload(emu, value, data, length);
+	case DFU_GETSTATUS:
+		return emu_get_status(emu, data, length);
+	case DFU_CLRSTATUS:
+		if (emu->state != DFU_STATE_dfuERROR)
+			return emu_stall(emu);
+		emu->state = DFU_STATE_dfuIDLE;
+		emu->status = DFU_STATUS_OK;
+		return 0;
+	case DFU_GETSTATE:
+		if (length < 1)
+			return emu_stall(emu);
+		data[0] = emu->state;
+		return 1;
+	default:
+		if (emu->state != DFU_STATE_dfuIDLE &&
+		    emu->state != DFU_STATE_dfuDNLOAD_IDLE &&
+		    emu->state != DFU_STATE_dfuUPLOAD_IDLE)
+			return emu_stall(emu);
+		emu->state = DFU_STATE_dfuIDLE;
+		return 0;
+	}
+}
+
+static int emu_control(libusb_device_handle *device, uint8_t request_type,
+		       uint8_t request, uint16_t value, uint16_t index,
+		       unsigned char *data, uint16_t length,
+		       unsigned int timeout)
+{
+	struct dfu_emu *emu = (struct dfu_emu *)device;
+	int ret;
+
+	(void)timeout;
+	/* the time the host spent between requests, for benchmarks */
+	if (emu->last_request_us)
+		emu->stats.idle_us += emu_time_us() - emu->last_request_us;
+	emu_delay_us(emu->p.usb_us);
+	ret = emu_request(emu, request_type, request, value, index, data,
+			  length);
+	emu->last_request_us = emu_time_us();
+	if (emu->manifest_start_us)
+		emu->stats.manifest_us = emu->last_request_us -
+		    emu->manifest_start_us;
+	return ret;
+}
+
+static int emu_claim(libusb_device_handle *device, int interface)
+{
+	(void)device;
+	return interface == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int emu_release(libusb_device_handle *device, int interface)
+{
+	(void)device;
+	(void)interface;
+	return 0;
+}
+
+static int emu_set_alt(libusb_device_handle *device, int interface, int alt)
+{
+	struct dfu_emu *emu = (struct dfu_emu *)device;
+
+	if (emu->left)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if (interface != 0 || alt < 0 || alt >= emu->alt_count)
+		return LIBUSB_ERROR_NOT_FOUND;
+	emu->alt = alt;
+	return 0;
+}
+
+static int emu_reset(libusb_device_handle *device)
+{
+	struct dfu_emu *emu = (struct dfu_emu *)device;
+
+	/* the device would boot its firmware now */
+	emu->left = 1;
+	return 0;
+}
+
+static void emu_close(libusb_device_handle *device)
+{
+	(void)device;
+}
+
+static int emu_get_alt_name(struct dfu_if *dif, int alt, char *name,
+			    int size)
+{
+	struct dfu_emu *emu = (struct dfu_emu *)dif->dev_handle;
+
+	if (alt < 0 || alt >= emu->alt_count)
+		return -1;
+	snprintf(name, size, "%s", emu->alts[alt].name);
+	return 0;
+}
+
+static const struct dfu_transport dfu_emu_transport = {
+	emu_control,
+	emu_claim,
+	emu_release,
+	emu_set_alt,
+	emu_reset,
+	emu_close,
+	emu_get_alt_name
+};
+
+void dfu_emu_help(void)
+{
+	unsigned int i;
+
+	printf("Emulated devices:\n");
+	for (i = 0; i < sizeof(dfu_emu_profiles) /
+	     sizeof(dfu_emu_profiles[0]); i++)
+		printf("  %-14s%s\n", dfu_emu_profiles[i].name,
+		       dfu_emu_profiles[i].description);
+	printf("Settings, appended as :<name>=<value>:\n"
+	       "  xfer          wTransferSize\n"
+	       "  usb           round trip of every request in us\n"
+	       "  write, erase  programming and erase time per KiB in ms\n"
+	       "  mass-erase, set-address, manifest\n"
+	       "                time of these operations in ms\n"
+	       "  poll          reported bwPollTimeout in ms, instead of "
+	       "the real times\n"
+	       "  serial        serial number string (GD32 model code)\n"
+	       "  size          memory of a plain DFU device in bytes\n"
+	       "  layout        DfuSe memory descriptor of alternate "
+	       "setting 0\n");
+}
+
+/* Applies the :<name>=<value> settings of an emulator spec. String
+ * settings point into settings, which must outlive the profile */
+static void emu_configure(struct dfu_emu_profile *p, char *settings)
+{
+	char *setting;
+
+	for (setting = strtok(settings, ":"); setting;
+	     setting = strtok(NULL, ":")) {
+		char *value = strchr(setting, '=');
+		char *end;
+		unsigned long number;
+
+		if (!value)
+			errx(EX_USAGE, "Emulator setting %s has no value",
+			     setting);
+		*value++ = 0;
+		if (!strcmp(setting, "serial")) {
+			p->serial = value;
+			continue;
+		}
+		if (!strcmp(setting, "layout")) {
+			p->alt_names[0] = value;
+			continue;
+		}
+		number = strtoul(value, &end, 0);
+		if (*end || end == value)
+			errx(EX_USAGE, "Invalid emulator setting value %s",
+			     value);
+		if (!strcmp(setting, "xfer") && number > 0 &&
+		    number <= 0xffff)
+			p->transfer_size = number;
+		else if (!strcmp(setting, "usb"))
+			p->usb_us = number;
+		else if (!strcmp(setting, "write"))
+			p->write_ms = number;
+		else if (!strcmp(setting, "erase"))
+			p->erase_ms = number;
+		else if (!strcmp(setting, "mass-erase"))
+			p->mass_erase_ms = number;
+		else if (!strcmp(setting, "set-address"))
+			p->set_address_ms = number;
+		else if (!strcmp(setting, "manifest"))
+			p->manifest_ms = number;
+		else if (!strcmp(setting, "poll"))
+			p->poll_ms = number;
+		else if (!strcmp(setting, "size") && number > 0)
+			p->image_size = number;
+		else
+			errx(EX_USAGE, "Unknown emulator setting %s", setting);
+	}
+}
+
+static void emu_add_alt(struct dfu_emu *emu, int quirks)
+{
+	struct dfu_emu_alt *alt = &emu->alts[emu->alt_count];
+	int i;
+
+	alt->name = emu->p.alt_names[emu->alt_count];
+	if (emu->dfuse) {
+		if ((quirks & QUIRK_GD32) && emu->alt_count == 0)
+			alt->layout = parse_memory_gd32((char *)emu->p.serial);
+		else
+			alt->layout = parse_memory_layout((char *)alt->name);
+		if (!alt->layout)
+			errx(EX_USAGE, "Invalid emulator memory layout %s",
+			     alt->name);
+		alt->memory = dfu_malloc(alt->layout->count *
+		    sizeof(*alt->memory));
+		for (i = 0; i < alt->layout->count; i++) {
+			struct memsegment *segment = &alt->layout->segments[i];
+			unsigned int size = segment->end - segment->start + 1;
+
+			alt->memory[i] = dfu_malloc(size);
+			memset(alt->memory[i], (segment->memtype &
+			    DFUSE_ERASABLE) ? 0xff : 0, size);
+		}
+	}
+	emu->alt_count++;
+}
+
+/*
+ * Creates an emulated device from a spec of a profile name followed by
+ * settings, like "gd32vf103cb:xfer=1024", and makes it the transport.
+ * Returns the DFU interface for the requested alternate setting.
+ */
+struct dfu_if *dfu_emu_open(const char *spec, int alt_index,
+			    const char *alt_name)
+{
+	struct dfu_emu *emu;
+	struct dfu_if *dif;
+	char *name = strdup(spec);
+	char *settings;
+	unsigned int i;
+
+	if (!name)
+		errx(EX_SOFTWARE, "Out of memory");
+	settings = strchr(name, ':');
+	if (settings)
+		*settings++ = 0;
+
+	emu = dfu_malloc(sizeof(*emu));
+	memset(emu, 0, sizeof(*emu));
+	emu->spec = name;
+	for (i = 0; i < sizeof(dfu_emu_profiles) /
+	     sizeof(dfu_emu_profiles[0]); i++)
+		if (!strcmp(dfu_emu_profiles[i].name, name))
+			break;
+	if (i == sizeof(dfu_emu_profiles) / sizeof(dfu_emu_profiles[0])) {
+		dfu_emu_help();
+		errx(EX_USAGE, "Unknown emulated device %s", name);
+	}
+	emu->p = dfu_emu_profiles[i];
+	if (settings)
+		emu_configure(&emu->p, settings);
+	emu->dfuse = emu->p.bcdDFU == 0x011a;
+
+	dif = dfu_malloc(sizeof(*dif));
+	memset(dif, 0, sizeof(*dif));
+	dif->func_dfu.bLength = USB_DT_DFU_SIZE;
+	dif->func_dfu.bDescriptorType = USB_DT_DFU;
+	dif->func_dfu.bmAttributes = emu->p.attributes;
+	dif->func_dfu.wDetachTimeOut = libusb_cpu_to_le16(255);
+	dif->func_dfu.wTransferSize = libusb_cpu_to_le16(emu->p.transfer_size);
+	dif->func_dfu.bcdDFUVersion = libusb_cpu_to_le16(emu->p.bcdDFU);
+	dif->vendor = emu->p.vendor;
+	dif->product = emu->p.product;
+	dif->bcdDevice = 0x0200;
+	dif->quirks = get_quirks(dif->vendor, dif->product, dif->bcdDevice);
+	dif->flags = DFU_IFF_DFU;
+	dif->bMaxPacketSize0 = 64;
+	dif->serial_name = strdup(emu->p.serial);
+	dif->dev_handle = (libusb_device_handle *)emu;
+
+	while (emu->alt_count < EMU_MAX_ALTS &&
+	       emu->p.alt_names[emu->alt_count])
+		emu_add_alt(emu, dif->quirks);
+	for (i = 0; alt_name && i < (unsigned int)emu->alt_count; i++)
+		if (!strcmp(emu->alts[i].name, alt_name))
+			alt_index = i;
+	if (alt_index < 0 && !alt_name)
+		alt_index = 0;
+	if (alt_index < 0 || alt_index >= emu->alt_count)
+		errx(EX_USAGE, "No such alternate setting on emulated device");
+	dif->altsetting = alt_index;
+	dif->alt_name = strdup(emu->alts[alt_index].name);
+	if (!dif->serial_name || !dif->alt_name)
+		errx(EX_SOFTWARE, "Out of memory");
+
+	emu->block = dfu_malloc(emu->p.transfer_size);
+	if (!emu->dfuse) {
+		emu->image = dfu_malloc(emu->p.image_size);
+		memset(emu->image, 0xff, emu->p.image_size);
+		emu->image_len = emu->p.image_size;
+	}
+	emu->state = DFU_STATE_dfuIDLE;
+	emu->status = DFU_STATUS_OK;
+	/* bootloaders point at the start of flash until told otherwise */
+	if (emu->dfuse)
+		emu->pointer = emu->alts[0].layout->segments[0].start;
+
+	printf("Emulating %s (%s)\n", emu->p.name, emu->p.description);
+	dfu_transport = &dfu_emu_transport;
+	return dif;
+}
+
+const struct dfu_emu_stats *dfu_emu_get_stats(struct dfu_if *dif)
+{
+	return &((struct dfu_emu *)dif->dev_handle)->stats;
+}
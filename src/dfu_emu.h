@@ -0,0 +1,25 @@
+#ifndef DFU_EMU_H
+#define DFU_EMU_H
+
+#include "dfu.h"
+
+/* Counters of an emulated device, for tests and benchmarks */
+struct dfu_emu_stats {
+	unsigned int requests[DFU_ABORT + 1];	/* by DFU request */
+	unsigned int busy_polls;	/* DFU_GETSTATUS while still busy */
+	unsigned int pages_erased;
+	unsigned int mass_erases;
+	unsigned int program_errors;	/* writes to memory not erased */
+	unsigned long long bytes_written;
+	unsigned long long bytes_read;
+	unsigned long long idle_us;	/* host time between requests */
+	unsigned long long manifest_us;	/* from the end of a download to
+					 * the last request */
+};
+
+struct dfu_if *dfu_emu_open(const char *spec, int alt_index,
+			    const char *alt_name);
+const struct dfu_emu_stats *dfu_emu_get_stats(struct dfu_if *dif);
+void dfu_emu_help(void);
+
+#endif /* DFU_EMU_H */
@@ -26,65 +26,36 @@
 #include <stdlib.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "portable.h"
 #include "dfu_file.h"
+#include "crc32.h"
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+# define DFU_FILE_MMAP
+#endif
+#if defined HAVE_GETRUSAGE && defined HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
 
 #define DFU_SUFFIX_LENGTH 16
 #define LMDFU_PREFIX_LENGTH 8
 #define LPCDFU_PREFIX_LENGTH 16
 #define PROGRESS_BAR_WIDTH 25
 #define STDIN_CHUNK_SIZE 65536
-
-static const unsigned long crc32_table[] = {
-    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
-
-static uint32_t crc32_byte(uint32_t accum, uint8_t delta)
-{
-        return crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
-}
+#define SINK_BUFFER_SIZE (256 * 1024)
+#define SOURCE_BUFFER_SIZE (1024 * 1024)
+/* smaller files are read, as a mapped file that is truncated while
+ * it is downloaded makes accesses to it fail with SIGBUS */
+#define MAP_MIN_SIZE (1024 * 1024)
 
 static int probe_prefix(struct dfu_file *file)
 {
@@ -157,13 +128,25 @@ void *dfu_malloc(size_t size)
 	return (ptr);
 }
 
-uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
+/* Monotonic time stamp in milliseconds, for transfer statistics */
+unsigned long long dfu_time_ms(void)
 {
-	int x;
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#elif defined HAVE_WINDOWS_H
+	return GetTickCount();
+#else
+	return (unsigned long long)time(NULL) * 1000;
+#endif
+}
 
+uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
+{
 	/* compute CRC */
-	for (x = 0; x != size; x++)
-		crc = crc32_byte(crc, ((uint8_t *)buf)[x]);
+	crc = crc32_update(crc, buf, size);
 
 	/* write data */
 	if (write(f, buf, size) != size)
@@ -172,11 +155,596 @@ uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
 	return (crc);
 }
 
+/*
+ * Upload output sink. Received data is collected in large buffers, which
+ * are written by a separate thread while the other buffer fills up, so
+ * that slow file I/O does not hold up the next upload request. Without
+ * thread support the buffers are written when full.
+ */
+struct dfu_sink {
+	int fd;
+	unsigned char *buf[2];
+	int fill;		/* buffer being filled */
+	int len;		/* bytes in the buffer being filled */
+	int pending;		/* bytes handed to the writer, 0 when idle */
+	int error;		/* errno of a failed write */
+#ifdef HAVE_PTHREAD_H
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int threaded;
+	int done;
+#endif
+};
+
+/* Returns 0 or the errno of the failed write */
+static int dfu_sink_write_out(int fd, const unsigned char *buf, int len)
+{
+	while (len > 0) {
+		int ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *dfu_sink_writer(void *arg)
+{
+	struct dfu_sink *sink = arg;
+
+	pthread_mutex_lock(&sink->lock);
+	while (1) {
+		unsigned char *buf;
+		int len;
+		int error;
+
+		while (!sink->pending && !sink->done)
+			pthread_cond_wait(&sink->cond, &sink->lock);
+		if (!sink->pending)
+			break;
+
+		/* the other buffer is not touched until pending is cleared */
+		buf = sink->buf[sink->fill ^ 1];
+		len = sink->pending;
+		pthread_mutex_unlock(&sink->lock);
+		error = dfu_sink_write_out(sink->fd, buf, len);
+		pthread_mutex_lock(&sink->lock);
+
+		if (error && !sink->error)
+			sink->error = error;
+		sink->pending = 0;
+		pthread_cond_broadcast(&sink->cond);
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return NULL;
+}
+#endif
+
+/* Passes the filled buffer on for writing */
+static void dfu_sink_handoff(struct dfu_sink *sink)
+{
+	int error;
+
+	if (sink->len == 0)
+		return;
+#ifdef HAVE_PTHREAD_H
+	if (sink->threaded) {
+		pthread_mutex_lock(&sink->lock);
+		while (sink->pending)
+			pthread_cond_wait(&sink->cond, &sink->lock);
+		sink->pending = sink->len;
+		sink->fill ^= 1;
+		sink->len = 0;
+		pthread_cond_broadcast(&sink->cond);
+		error = sink->error;
+		pthread_mutex_unlock(&sink->lock);
+	} else
+#endif
+	{
+		error = dfu_sink_write_out(sink->fd, sink->buf[sink->fill],
+		    sink->len);
+		sink->len = 0;
+	}
+	if (error) {
+		errno = error;
+		err(EX_IOERR, "Could not write to file %d", sink->fd);
+	}
+}
+
+struct dfu_sink *dfu_sink_open(int fd)
+{
+	struct dfu_sink *sink;
+
+	sink = dfu_malloc(sizeof(*sink));
+	memset(sink, 0, sizeof(*sink));
+	sink->fd = fd;
+	sink->buf[0] = dfu_malloc(SINK_BUFFER_SIZE);
+	sink->buf[1] = dfu_malloc(SINK_BUFFER_SIZE);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->cond, NULL);
+	sink->threaded = !pthread_create(&sink->thread, NULL,
+	    dfu_sink_writer, sink);
+#endif
+	return sink;
+}
+
+void dfu_sink_write(struct dfu_sink *sink, const void *buf, int size)
+{
+	const unsigned char *data = buf;
+
+	while (size > 0) {
+		int chunk = SINK_BUFFER_SIZE - sink->len;
+
+		if (chunk > size)
+			chunk = size;
+		memcpy(sink->buf[sink->fill] + sink->len, data, chunk);
+		sink->len += chunk;
+		data += chunk;
+		size -= chunk;
+		if (sink->len == SINK_BUFFER_SIZE)
+			dfu_sink_handoff(sink);
+	}
+}
+
+/* Writes out all data and frees the sink, the file is left open */
+void dfu_sink_close(struct dfu_sink *sink)
+{
+	int error;
+
+	dfu_sink_handoff(sink);
+#ifdef HAVE_PTHREAD_H
+	if (sink->threaded) {
+		pthread_mutex_lock(&sink->lock);
+		sink->done = 1;
+		pthread_cond_broadcast(&sink->cond);
+		pthread_mutex_unlock(&sink->lock);
+		pthread_join(sink->thread, NULL);
+	}
+	pthread_cond_destroy(&sink->cond);
+	pthread_mutex_destroy(&sink->lock);
+#endif
+	error = sink->error;
+	free(sink->buf[0]);
+	free(sink->buf[1]);
+	free(sink);
+	if (error) {
+		errno = error;
+		err(EX_IOERR, "Could not write to file");
+	}
+}
+
+/* Gives back the memory of a loaded file */
+static void dfu_release_firmware(struct dfu_file *file)
+{
+	int i;
+
+	for (i = 0; i < file->segment_count; i++)
+		if (file->segments[i].capacity)
+			free(file->segments[i].data);
+	free(file->segments);
+	file->segments = NULL;
+	file->segment_count = 0;
+#ifdef DFU_FILE_MMAP
+	if (file->mapped) {
+		munmap(file->firmware, file->mapped);
+		file->firmware = NULL;
+		file->mapped = 0;
+		return;
+	}
+#endif
+	free(file->firmware);
+	file->firmware = NULL;
+}
+
+/*
+ * Reads a file or stream until end of file, computing the CRC over all
+ * but the last 4 bytes (the CRC field of a possible suffix) while the
+ * data is still in cache. The buffer grows geometrically, so that
+ * streams of unknown size are not copied over and over.
+ */
+static uint32_t dfu_read_fd(struct dfu_file *file, int fd, size_t size_hint)
+{
+	uint32_t crc = 0xffffffff;
+	size_t capacity = size_hint ? size_hint + 1 : STDIN_CHUNK_SIZE;
+	size_t total = 0;
+	size_t crc_len = 0;
+
+	file->firmware = dfu_malloc(capacity);
+	while (1) {
+		ssize_t r;
+
+		if (total == capacity) {
+			if (capacity > INT32_MAX / 2)
+				errx(EX_IOERR, "File size is too big");
+			capacity *= 2;
+			file->firmware = realloc(file->firmware, capacity);
+			if (!file->firmware)
+				err(EX_IOERR, "Could not allocate firmware buffer");
+		}
+		r = read(fd, file->firmware + total, capacity - total);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EX_IOERR, "Could not read from %s", file->name);
+		}
+		if (r == 0)
+			break;
+		total += r;
+		if (total > 4 && total - 4 > crc_len) {
+			crc = crc32_update(crc, file->firmware + crc_len,
+					   total - 4 - crc_len);
+			crc_len = total - 4;
+		}
+	}
+	file->size.total = total;
+	return crc;
+}
+
+#ifdef DFU_FILE_MMAP
+/* Maps a regular file and computes the CRC as in dfu_read_fd(), the CRC
+ * pass being the one that faults the pages in. Returns 0 on success */
+static int dfu_map_fd(struct dfu_file *file, int fd, size_t size,
+		      uint32_t *crc)
+{
+	void *map;
+
+	if (size < MAP_MIN_SIZE)
+		return -1;
+	/* private and writable, so the callers may still modify it */
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+#ifdef HAVE_MADVISE
+	madvise(map, size, MADV_SEQUENTIAL);
+#endif
+	file->firmware = map;
+	file->mapped = size;
+	file->size.total = size;
+	*crc = 0xffffffff;
+	if (size > 4)
+		*crc = crc32_update(*crc, file->firmware, size - 4);
+	return 0;
+}
+#endif /* DFU_FILE_MMAP */
+
+/* Peak resident set size in kiB, or -1 if not known */
+static long dfu_peak_rss(void)
+{
+#if defined HAVE_GETRUSAGE && defined HAVE_SYS_RESOURCE_H
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef __APPLE__
+		return usage.ru_maxrss / 1024;
+#else
+		return usage.ru_maxrss;
+#endif
+#endif
+	return -1;
+}
+
+/* Checks signature and CRC of a DFU suffix, the CRC being computed over
+ * everything up to the CRC field. Returns NULL if valid, else the reason */
+static const char *dfu_check_suffix(const uint8_t *dfusuffix, uint32_t crc)
+{
+	uint32_t dwCRC;
+
+	if (dfusuffix[10] != 'D' ||
+	    dfusuffix[9]  != 'F' ||
+	    dfusuffix[8]  != 'U')
+		return "Invalid DFU suffix signature";
+
+	dwCRC = (dfusuffix[15] << 24) +
+	    (dfusuffix[14] << 16) +
+	    (dfusuffix[13] << 8) +
+	    dfusuffix[12];
+
+	if (dwCRC != crc)
+		return "DFU suffix CRC does not match";
+	return NULL;
+}
+
+/*
+ * Download source for streams. A reader thread fills a ring buffer from
+ * the stream while the download drains it, so that producing the image
+ * overlaps with flashing it, and memory use does not depend on the image
+ * size. The last DFU_SUFFIX_LENGTH bytes are held back until the end of
+ * the stream shows whether they are a DFU suffix or payload. Without
+ * threads the stream is read on demand.
+ */
+struct dfu_source {
+	int fd;
+	unsigned char *buf;
+	size_t head;		/* next byte to hand out */
+	size_t count;		/* bytes in the ring */
+	int eof;
+	int error;		/* errno of a failed read */
+	int suffix;		/* 1 if the held back bytes are a suffix */
+	int suffix_checked;
+	uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
+	uint32_t crc;		/* over the bytes handed out */
+	unsigned long long total;
+	int (*ids_match)(const struct dfu_file *file);
+#ifdef HAVE_PTHREAD_H
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int threaded;
+#endif
+};
+
+/* Reads once into the free part of the ring, the caller makes sure
+ * there is some. Returns the number of bytes read, 0 at the end */
+static int dfu_source_fill(struct dfu_source *source, size_t tail,
+			   size_t space)
+{
+	ssize_t r;
+
+	if (space > SOURCE_BUFFER_SIZE - tail)
+		space = SOURCE_BUFFER_SIZE - tail;
+	do {
+		r = read(source->fd, source->buf + tail, space);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -errno;
+	return r;
+}
+
+/* Accounts for a completed read, with the lock held if threaded */
+static void dfu_source_filled(struct dfu_source *source, int r)
+{
+	if (r < 0)
+		source->error = -r;
+	else if (r == 0)
+		source->eof = 1;
+	else
+		source->count += r;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *dfu_source_reader(void *arg)
+{
+	struct dfu_source *source = arg;
+
+	pthread_mutex_lock(&source->lock);
+	while (!source->eof && !source->error) {
+		size_t tail;
+		size_t space;
+		int r;
+
+		while (source->count == SOURCE_BUFFER_SIZE)
+			pthread_cond_wait(&source->cond, &source->lock);
+		/* only the free part of the ring is written outside the lock */
+		tail = (source->head + source->count) % SOURCE_BUFFER_SIZE;
+		space = SOURCE_BUFFER_SIZE - source->count;
+		pthread_mutex_unlock(&source->lock);
+		r = dfu_source_fill(source, tail, space);
+		pthread_mutex_lock(&source->lock);
+
+		dfu_source_filled(source, r);
+		pthread_cond_broadcast(&source->cond);
+	}
+	pthread_mutex_unlock(&source->lock);
+	return NULL;
+}
+#endif
+
+/* Copies bytes out of the ring without consuming them */
+static void dfu_source_peek(struct dfu_source *source, size_t offset,
+			    unsigned char *buf, size_t size)
+{
+	size_t start = (source->head + offset) % SOURCE_BUFFER_SIZE;
+	size_t first = SOURCE_BUFFER_SIZE - start;
+
+	if (first > size)
+		first = size;
+	memcpy(buf, source->buf + start, first);
+	memcpy(buf + first, source->buf, size - first);
+}
+
+/* At the end of the stream, decides whether the held back bytes are a
+ * DFU suffix. The CRC must also cover the bytes not handed out yet */
+static void dfu_source_check_suffix(struct dfu_source *source)
+{
+	unsigned char tmp[4096];
+	uint32_t crc = source->crc;
+	size_t offset = 0;
+	size_t rest;
+
+	source->suffix_checked = 1;
+	if (source->count < DFU_SUFFIX_LENGTH)
+		return;
+	rest = source->count - 4;
+	while (offset < rest) {
+		size_t n = rest - offset;
+
+		if (n > sizeof(tmp))
+			n = sizeof(tmp);
+		dfu_source_peek(source, offset, tmp, n);
+		crc = crc32_update(crc, tmp, n);
+		offset += n;
+	}
+	dfu_source_peek(source, source->count - DFU_SUFFIX_LENGTH,
+			source->dfusuffix, DFU_SUFFIX_LENGTH);
+	source->suffix = !dfu_check_suffix(source->dfusuffix, crc);
+}
+
+void dfu_source_open(struct dfu_file *file,
+		     int (*ids_match)(const struct dfu_file *file))
+{
+	struct dfu_source *source;
+
+	dfu_release_firmware(file);
+	file->size.total = 0;
+	file->size.prefix = 0;
+	file->size.suffix = 0;
+	file->bcdDFU = 0;
+	file->idVendor = 0xffff;
+	file->idProduct = 0xffff;
+	file->bcdDevice = 0xffff;
+	file->lmdfu_address = 0;
+
+	source = dfu_malloc(sizeof(*source));
+	memset(source, 0, sizeof(*source));
+	source->crc = 0xffffffff;
+	source->ids_match = ids_match;
+	source->buf = dfu_malloc(SOURCE_BUFFER_SIZE);
+	if (!strcmp(file->name, "-")) {
+#ifdef WIN32
+		_setmode( _fileno( stdin ), _O_BINARY );
+#endif
+		source->fd = fileno(stdin);
+	} else {
+		source->fd = open(file->name, O_RDONLY | O_BINARY);
+		if (source->fd < 0)
+			err(EX_IOERR, "Could not open file %s for reading",
+			    file->name);
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&source->lock, NULL);
+	pthread_cond_init(&source->cond, NULL);
+	source->threaded = !pthread_create(&source->thread, NULL,
+	    dfu_source_reader, source);
+#endif
+	file->source = source;
+}
+
+/*
+ * Hands out the next size bytes of payload, waiting for the stream as
+ * needed. Returns fewer bytes only at the end of the stream, and 0 once
+ * all payload has been handed out.
+ */
+int dfu_source_read(struct dfu_source *source, unsigned char *buf, int size)
+{
+	size_t avail;
+	int error;
+
+#ifdef HAVE_PTHREAD_H
+	if (source->threaded) {
+		pthread_mutex_lock(&source->lock);
+		while (source->count < (size_t)size + DFU_SUFFIX_LENGTH &&
+		       !source->eof && !source->error)
+			pthread_cond_wait(&source->cond, &source->lock);
+		pthread_mutex_unlock(&source->lock);
+	} else
+#endif
+	{
+		while (source->count < (size_t)size + DFU_SUFFIX_LENGTH &&
+		       !source->eof && !source->error) {
+			size_t tail = (source->head + source->count) %
+			    SOURCE_BUFFER_SIZE;
+
+			dfu_source_filled(source, dfu_source_fill(source, tail,
+			    SOURCE_BUFFER_SIZE - source->count));
+		}
+	}
+	/* the reader thread only ever adds to count, and has stopped
+	 * if eof or error is set */
+	error = source->error;
+	if (error) {
+		errno = error;
+		err(EX_IOERR, "Could not read download stream");
+	}
+	if (source->eof && !source->suffix_checked)
+		dfu_source_check_suffix(source);
+
+	avail = source->count;
+	if (source->suffix)
+		avail -= DFU_SUFFIX_LENGTH;
+	else if (!source->eof)
+		avail -= DFU_SUFFIX_LENGTH;
+	if ((size_t)size > avail)
+		size = avail;
+
+	dfu_source_peek(source, 0, buf, size);
+	source->crc = crc32_update(source->crc, buf, size);
+	source->total += size;
+
+#ifdef HAVE_PTHREAD_H
+	if (source->threaded) {
+		pthread_mutex_lock(&source->lock);
+		source->head = (source->head + size) % SOURCE_BUFFER_SIZE;
+		source->count -= size;
+		pthread_cond_broadcast(&source->cond);
+		pthread_mutex_unlock(&source->lock);
+		return size;
+	}
+#endif
+	source->head = (source->head + size) % SOURCE_BUFFER_SIZE;
+	source->count -= size;
+	return size;
+}
+
+/*
+ * Called when all payload has been downloaded, before the download is
+ * completed. Takes over the suffix fields, refuses to complete the
+ * download if the suffix names another device, and frees the source.
+ */
+void dfu_source_finish(struct dfu_file *file)
+{
+	struct dfu_source *source = file->source;
+	const uint8_t *dfusuffix = source->dfusuffix;
+	int (*ids_match)(const struct dfu_file *file) = source->ids_match;
+
+	if (!source->suffix_checked)
+		errx(EX_SOFTWARE, "Download stream was not read to the end");
+#ifdef HAVE_PTHREAD_H
+	if (source->threaded)
+		pthread_join(source->thread, NULL);
+	pthread_cond_destroy(&source->cond);
+	pthread_mutex_destroy(&source->lock);
+#endif
+	if (source->fd != fileno(stdin))
+		close(source->fd);
+
+	file->size.total = source->total;
+	if (source->suffix) {
+		file->size.total += DFU_SUFFIX_LENGTH;
+		file->size.suffix = dfusuffix[11];
+		if (file->size.suffix != DFU_SUFFIX_LENGTH)
+			errx(EX_IOERR, "Unsupported DFU suffix length %d for "
+			     "streaming", file->size.suffix);
+		file->dwCRC = (dfusuffix[15] << 24) +
+		    (dfusuffix[14] << 16) +
+		    (dfusuffix[13] << 8) +
+		    dfusuffix[12];
+		file->bcdDFU = (dfusuffix[7] << 8) + dfusuffix[6];
+		file->idVendor	= (dfusuffix[5] << 8) + dfusuffix[4];
+		file->idProduct = (dfusuffix[3] << 8) + dfusuffix[2];
+		file->bcdDevice = (dfusuffix[1] << 8) + dfusuffix[0];
+		if (verbose)
+			printf("DFU suffix version %x\n", file->bcdDFU);
+	} else {
+		warnx("No valid DFU suffix at end of stream");
+		warnx("A valid DFU suffix will be required in "
+		      "a future dfu-util release!!!");
+	}
+	if (verbose)
+		printf("Streamed %i bytes\n", file->size.total);
+
+	free(source->buf);
+	free(source);
+	file->source = NULL;
+
+	if (file->size.suffix && ids_match && !ids_match(file))
+		errx(EX_IOERR, "Error: File ID %04x:%04x does not match "
+		     "device, not completing the download",
+		     file->idVendor, file->idProduct);
+}
+
 void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix)
 {
-	off_t offset;
+	unsigned long long start = dfu_time_ms();
+	uint32_t crc;
 	int f;
-	int i;
 	int res;
 
 	file->size.prefix = 0;
@@ -191,54 +759,51 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum pre
 	/* default values, if no valid prefix is found */
 	file->lmdfu_address = 0;
 
-	free(file->firmware);
+	dfu_release_firmware(file);
 
 	if (!strcmp(file->name, "-")) {
-		int read_bytes;
-
 #ifdef WIN32
 		_setmode( _fileno( stdin ), _O_BINARY );
 #endif
-		file->firmware = (uint8_t*) dfu_malloc(STDIN_CHUNK_SIZE);
-		read_bytes = fread(file->firmware, 1, STDIN_CHUNK_SIZE, stdin);
-		file->size.total = read_bytes;
-		while (read_bytes == STDIN_CHUNK_SIZE) {
-			file->firmware = (uint8_t*) realloc(file->firmware, file->size.total + STDIN_CHUNK_SIZE);
-			if (!file->firmware)
-				err(EX_IOERR, "Could not allocate firmware buffer");
-			read_bytes = fread(file->firmware + file->size.total, 1, STDIN_CHUNK_SIZE, stdin);
-			file->size.total += read_bytes;
-		}
-		if (verbose)
-			printf("Read %i bytes from stdin\n", file->size.total);
+		crc = dfu_read_fd(file, fileno(stdin), 0);
 		/* Never require suffix when reading from stdin */
 		check_suffix = MAYBE_SUFFIX;
 	} else {
+		struct stat st;
+
 		f = open(file->name, O_RDONLY | O_BINARY);
 		if (f < 0)
 			err(EX_IOERR, "Could not open file %s for reading", file->name);
 
-		offset = lseek(f, 0, SEEK_END);
-
-		if ((int)offset < 0 || (int)offset != offset)
-			err(EX_IOERR, "File size is too big");
-
-		if (lseek(f, 0, SEEK_SET) != 0)
-			err(EX_IOERR, "Could not seek to beginning");
-
-		file->size.total = offset;
-		file->firmware = dfu_malloc(file->size.total);
+		if (fstat(f, &st) < 0)
+			err(EX_IOERR, "Could not stat %s", file->name);
 
-		if (read(f, file->firmware, file->size.total) != file->size.total) {
-			err(EX_IOERR, "Could not read %d bytes from %s",
-			    file->size.total, file->name);
+		if (!S_ISREG(st.st_mode)) {
+			/* a pipe or device, read it like stdin */
+			crc = dfu_read_fd(file, f, 0);
+		} else {
+			if ((int)st.st_size < 0 || (int)st.st_size != st.st_size)
+				errx(EX_IOERR, "File size is too big");
+#ifdef DFU_FILE_MMAP
+			if (dfu_map_fd(file, f, st.st_size, &crc) != 0)
+#endif
+				crc = dfu_read_fd(file, f, st.st_size);
 		}
 		close(f);
 	}
+	if (verbose) {
+		long rss = dfu_peak_rss();
+
+		printf("Loaded %i bytes from %s in %llu ms%s", file->size.total,
+		       file->name, dfu_time_ms() - start,
+		       file->mapped ? " (mapped)" : "");
+		if (rss >= 0)
+			printf(", peak RSS %li kiB", rss);
+		printf("\n");
+	}
 
 	/* Check for possible DFU file suffix by trying to parse one */
 	{
-		uint32_t crc = 0xffffffff;
 		const uint8_t *dfusuffix;
 		int missing_suffix = 0;
 		const char *reason;
@@ -252,13 +817,8 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum pre
 		dfusuffix = file->firmware + file->size.total -
 		    DFU_SUFFIX_LENGTH;
 
-		for (i = 0; i < file->size.total - 4; i++)
-			crc = crc32_byte(crc, file->firmware[i]);
-
-		if (dfusuffix[10] != 'D' ||
-		    dfusuffix[9]  != 'F' ||
-		    dfusuffix[8]  != 'U') {
-			reason = "Invalid DFU suffix signature";
+		reason = dfu_check_suffix(dfusuffix, crc);
+		if (reason) {
 			missing_suffix = 1;
 			goto checked;
 		}
@@ -268,12 +828,6 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum pre
 		    (dfusuffix[13] << 8) +
 		    dfusuffix[12];
 
-		if (file->dwCRC != crc) {
-			reason = "DFU suffix CRC does not match";
-			missing_suffix = 1;
-			goto checked;
-		}
-
 		/* At this point we believe we have a DFU suffix
 		   so we require further checks to succeed */
 
@@ -344,6 +898,16 @@ void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix)
 	uint32_t crc = 0xffffffff;
 	int f;
 
+	/* the file is about to be rewritten, so a mapping of it must be
+	 * copied to memory first */
+	if (file->mapped) {
+		uint8_t *copy = dfu_malloc(file->mapped);
+
+		memcpy(copy, file->firmware, file->mapped);
+		dfu_release_firmware(file);
+		file->firmware = copy;
+	}
+
 	f = open(file->name, O_WRONLY | O_BINARY | O_TRUNC | O_CREAT, 0666);
 	if (f < 0)
 		err(EX_IOERR, "Could not open file %s for writing", file->name);
@@ -2,13 +2,30 @@
 #ifndef DFU_FILE_H
 #define DFU_FILE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* A piece of an image file that has its own load address */
+struct dfu_segment {
+    uint32_t address;
+    uint32_t size;
+    uint8_t *data;
+    /* Allocated size of data, 0 if it points into the file buffer */
+    size_t capacity;
+};
+
 struct dfu_file {
     /* File name */
     const char *name;
     /* Pointer to file loaded into memory */
     uint8_t *firmware;
+    /* Length of the mapping if firmware is mapped from the file, or 0 */
+    size_t mapped;
+    /* Stream to download from instead of firmware, see dfu_source_open() */
+    struct dfu_source *source;
+    /* Sorted by address, for image files with addresses (dfu_image.c) */
+    struct dfu_segment *segments;
+    int segment_count;
     /* Different sizes */
     struct {
 	int total;
@@ -54,7 +71,19 @@ void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix);
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max);
 void *dfu_malloc(size_t size);
+unsigned long long dfu_time_ms(void);
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size);
+
+struct dfu_sink;
+struct dfu_sink *dfu_sink_open(int fd);
+void dfu_sink_write(struct dfu_sink *sink, const void *buf, int size);
+void dfu_sink_close(struct dfu_sink *sink);
+
+struct dfu_source;
+void dfu_source_open(struct dfu_file *file,
+		int (*ids_match)(const struct dfu_file *file));
+int dfu_source_read(struct dfu_source *source, unsigned char *buf, int size);
+void dfu_source_finish(struct dfu_file *file);
 void show_suffix_and_prefix(struct dfu_file *file);
 
 #endif /* DFU_FILE_H */
@@ -0,0 +1,408 @@
+/*
+ * Intel HEX, Motorola S-record and ELF32 image files
+ *
+ * These formats carry the load address of their data, so they can hold
+ * widely separated pieces of memory without padding. They are parsed
+ * into a sorted list of segments, which DfuSe downloads write as they
+ * are, erasing only the pages that hold data.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfu_image.h"
+
+#define ELF32_HEADER_SIZE 52
+#define ELF32_PHDR_SIZE 32
+#define ELF_PT_LOAD 1
+
+/* A record of a text format, decoded from its hex digits */
+struct image_record {
+	uint8_t bytes[260];
+	int count;		/* number of bytes decoded */
+	int length;		/* number of characters consumed */
+};
+
+static int hex_digit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Decodes count bytes from pairs of hex digits. Returns 0 on success */
+static int hex_decode(const uint8_t *p, const uint8_t *end, uint8_t *out,
+		      int count)
+{
+	int i;
+
+	if (end - p < 2 * count)
+		return -1;
+	for (i = 0; i < count; i++) {
+		int hi = hex_digit(p[2 * i]);
+		int lo = hex_digit(p[2 * i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return -1;
+		out[i] = hi << 4 | lo;
+	}
+	return 0;
+}
+
+/* Decodes an Intel HEX record starting at ':' and checks its checksum.
+ * Returns 0 on success */
+static int ihex_record(const uint8_t *p, const uint8_t *end,
+		       struct image_record *rec)
+{
+	uint8_t sum = 0;
+	int i;
+
+	if (p == end || *p != ':')
+		return -1;
+	p++;
+	if (hex_decode(p, end, rec->bytes, 1))
+		return -1;
+	rec->count = rec->bytes[0] + 5;
+	if (hex_decode(p, end, rec->bytes, rec->count))
+		return -1;
+	for (i = 0; i < rec->count; i++)
+		sum += rec->bytes[i];
+	rec->length = 1 + 2 * rec->count;
+	return sum ? -1 : 0;
+}
+
+/* Decodes an S-record starting at 'S' and checks its checksum. The type
+ * digit is left in bytes[0], followed by the count byte. Returns 0 on
+ * success */
+static int srec_record(const uint8_t *p, const uint8_t *end,
+		       struct image_record *rec)
+{
+	uint8_t sum = 0;
+	int i;
+
+	if (end - p < 2 || p[0] != 'S' || p[1] < '0' || p[1] > '9')
+		return -1;
+	rec->bytes[0] = p[1] - '0';
+	p += 2;
+	if (hex_decode(p, end, rec->bytes + 1, 1))
+		return -1;
+	rec->count = rec->bytes[1] + 2;
+	if (rec->count < 3 || hex_decode(p, end, rec->bytes + 1,
+					 rec->count - 1))
+		return -1;
+	for (i = 1; i < rec->count; i++)
+		sum += rec->bytes[i];
+	rec->length = 2 + 2 * (rec->count - 1);
+	return sum == 0xff ? 0 : -1;
+}
+
+static const uint8_t *skip_space(const uint8_t *p, const uint8_t *end,
+				 int *line)
+{
+	while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' ||
+			   *p == '\t')) {
+		if (*p == '\n')
+			(*line)++;
+		p++;
+	}
+	return p;
+}
+
+static struct dfu_segment *image_new_segment(struct dfu_file *file,
+					     uint32_t address)
+{
+	struct dfu_segment *segment;
+
+	file->segments = realloc(file->segments, (file->segment_count + 1) *
+				 sizeof(*file->segments));
+	if (!file->segments)
+		errx(EX_SOFTWARE, "Out of memory");
+	segment = &file->segments[file->segment_count++];
+	memset(segment, 0, sizeof(*segment));
+	segment->address = address;
+	return segment;
+}
+
+/* Adds a copy of data at an address, extending the last segment if the
+ * data follows on from it, as it mostly does in text formats */
+static void image_add(struct dfu_file *file, uint32_t address,
+		      const uint8_t *data, uint32_t size)
+{
+	struct dfu_segment *segment = NULL;
+
+	if (size == 0)
+		return;
+	if ((uint64_t)address + size > 0x100000000ULL)
+		errx(EX_IOERR, "Image data at 0x%08x beyond 32-bit address "
+		     "space", address);
+	if (file->segment_count)
+		segment = &file->segments[file->segment_count - 1];
+	if (!segment || !segment->capacity ||
+	    segment->address + segment->size != address)
+		segment = image_new_segment(file, address);
+
+	if (segment->size + size > segment->capacity) {
+		size_t capacity = segment->capacity ? segment->capacity : 4096;
+
+		while (capacity < segment->size + size)
+			capacity *= 2;
+		segment->data = realloc(segment->data, capacity);
+		if (!segment->data)
+			errx(EX_SOFTWARE, "Out of memory");
+		segment->capacity = capacity;
+	}
+	memcpy(segment->data + segment->size, data, size);
+	segment->size += size;
+}
+
+static void ihex_parse(struct dfu_file *file, const uint8_t *p,
+		       const uint8_t *end)
+{
+	struct image_record rec;
+	uint32_t base = 0;
+	int line = 1;
+
+	while (1) {
+		uint8_t *b = rec.bytes;
+
+		p = skip_space(p, end, &line);
+		if (p == end) {
+			warnx("Intel HEX file has no end of file record");
+			return;
+		}
+		if (ihex_record(p, end, &rec))
+			errx(EX_IOERR, "Invalid Intel HEX record in line %i",
+			     line);
+		p += rec.length;
+
+		/* all but data records have a fixed length */
+		if ((b[3] == 0x01 && b[0] != 0) ||
+		    ((b[3] == 0x02 || b[3] == 0x04) && b[0] != 2) ||
+		    ((b[3] == 0x03 || b[3] == 0x05) && b[0] != 4))
+			errx(EX_IOERR, "Invalid length %i of Intel HEX record "
+			     "type %i in line %i", b[0], b[3], line);
+
+		switch (b[3]) {
+		case 0x00:	/* data */
+			image_add(file, base + (b[1] << 8 | b[2]), b + 4,
+				  b[0]);
+			break;
+		case 0x01:	/* end of file */
+			return;
+		case 0x02:	/* extended segment address */
+			base = (uint32_t)(b[4] << 8 | b[5]) << 4;
+			break;
+		case 0x04:	/* extended linear address */
+			base = (uint32_t)(b[4] << 8 | b[5]) << 16;
+			break;
+		case 0x03:	/* start segment address */
+		case 0x05:	/* start linear address */
+			break;
+		default:
+			errx(EX_IOERR, "Unknown Intel HEX record type %i in "
+			     "line %i", b[3], line);
+		}
+	}
+}
+
+static void srec_parse(struct dfu_file *file, const uint8_t *p,
+		       const uint8_t *end)
+{
+	/* address length by record type, 0 for reserved types */
+	static const int address_length[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+	struct image_record rec;
+	int line = 1;
+
+	while (1) {
+		uint8_t *b = rec.bytes;
+		uint32_t address = 0;
+		int alen;
+		int i;
+
+		p = skip_space(p, end, &line);
+		if (p == end) {
+			warnx("S-record file has no termination record");
+			return;
+		}
+		if (srec_record(p, end, &rec))
+			errx(EX_IOERR, "Invalid S-record in line %i", line);
+		p += rec.length;
+
+		alen = address_length[b[0]];
+		/* count and termination records hold no data */
+		if (!alen || rec.count < alen + 3 ||
+		    (b[0] >= 5 && rec.count != alen + 3))
+			errx(EX_IOERR, "Invalid S%i record in line %i", b[0],
+			     line);
+		for (i = 0; i < alen; i++)
+			address = address << 8 | b[2 + i];
+
+		if (b[0] >= 1 && b[0] <= 3)
+			image_add(file, address, b + 2 + alen,
+				  rec.count - alen - 3);
+		else if (b[0] >= 7)
+			return;
+	}
+}
+
+static uint32_t elf_read(const uint8_t *p, int size, int big_endian)
+{
+	uint32_t value = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		value |= (uint32_t)p[big_endian ? size - 1 - i : i] << (8 * i);
+	return value;
+}
+
+/* Takes the loadable parts of an ELF file from its program headers, at
+ * their physical (load) addresses. The data stays in the file buffer */
+static void elf_parse(struct dfu_file *file, const uint8_t *data,
+		      uint32_t size)
+{
+	uint32_t phoff, phentsize, phnum;
+	int be;
+	uint32_t i;
+
+	if (size < ELF32_HEADER_SIZE)
+		errx(EX_IOERR, "ELF file too short");
+	if (data[4] != 1)
+		errx(EX_IOERR, "Only 32-bit ELF files are supported");
+	if (data[5] != 1 && data[5] != 2)
+		errx(EX_IOERR, "Unknown ELF data encoding %i", data[5]);
+	be = data[5] == 2;
+
+	phoff = elf_read(data + 28, 4, be);
+	phentsize = elf_read(data + 42, 2, be);
+	phnum = elf_read(data + 44, 2, be);
+	if (phnum == 0)
+		errx(EX_IOERR, "ELF file has no program headers");
+	if (phentsize < ELF32_PHDR_SIZE || phoff > size ||
+	    (uint64_t)phnum * phentsize > size - phoff)
+		errx(EX_IOERR, "Invalid ELF program header table");
+
+	for (i = 0; i < phnum; i++) {
+		const uint8_t *ph = data + phoff + i * phentsize;
+		uint32_t offset = elf_read(ph + 4, 4, be);
+		uint32_t paddr = elf_read(ph + 12, 4, be);
+		uint32_t filesz = elf_read(ph + 16, 4, be);
+		struct dfu_segment *segment;
+
+		if (elf_read(ph, 4, be) != ELF_PT_LOAD || filesz == 0)
+			continue;
+		if (offset > size || filesz > size - offset)
+			errx(EX_IOERR, "ELF program header %i beyond end of "
+			     "file", i);
+		if ((uint64_t)paddr + filesz > 0x100000000ULL)
+			errx(EX_IOERR, "ELF segment at 0x%08x beyond 32-bit "
+			     "address space", paddr);
+		segment = image_new_segment(file, paddr);
+		segment->size = filesz;
+		segment->data = (uint8_t *)data + offset;
+	}
+	if (file->segment_count == 0)
+		errx(EX_IOERR, "ELF file has no loadable data");
+}
+
+static int image_compare(const void *a, const void *b)
+{
+	const struct dfu_segment *sa = a;
+	const struct dfu_segment *sb = b;
+
+	return (sa->address > sb->address) - (sa->address < sb->address);
+}
+
+const char *dfu_image_format_name(enum dfu_image_format format)
+{
+	switch (format) {
+	case IMAGE_IHEX:
+		return "Intel HEX";
+	case IMAGE_SREC:
+		return "S-record";
+	case IMAGE_ELF:
+		return "ELF";
+	default:
+		return "binary";
+	}
+}
+
+/*
+ * Recognizes an image file with addresses by its content and parses it
+ * into file->segments, sorted by address. Text formats are only taken
+ * as such if their first record is valid, errors after that are fatal.
+ * Anything else is left alone as a raw binary.
+ */
+enum dfu_image_format dfu_image_parse(struct dfu_file *file)
+{
+	const uint8_t *data = file->firmware + file->size.prefix;
+	uint32_t size = file->size.total - file->size.prefix -
+	    file->size.suffix;
+	const uint8_t *end = data + size;
+	const uint8_t *p;
+	struct image_record rec;
+	enum dfu_image_format format;
+	uint64_t total = 0;
+	int line = 1;
+	int i;
+
+	p = skip_space(data, end, &line);
+	if (size >= 4 && !memcmp(data, "\177ELF", 4)) {
+		format = IMAGE_ELF;
+		elf_parse(file, data, size);
+	} else if (!ihex_record(p, end, &rec)) {
+		format = IMAGE_IHEX;
+		ihex_parse(file, p, end);
+	} else if (!srec_record(p, end, &rec)) {
+		format = IMAGE_SREC;
+		srec_parse(file, p, end);
+	} else {
+		return IMAGE_BINARY;
+	}
+	if (file->segment_count == 0)
+		errx(EX_IOERR, "%s file holds no data",
+		     dfu_image_format_name(format));
+
+	qsort(file->segments, file->segment_count, sizeof(*file->segments),
+	      image_compare);
+	for (i = 0; i < file->segment_count; i++) {
+		struct dfu_segment *segment = &file->segments[i];
+
+		if (i > 0 && (uint64_t)segment[-1].address +
+		    segment[-1].size > segment->address)
+			errx(EX_IOERR, "%s file has overlapping data at "
+			     "0x%08x", dfu_image_format_name(format),
+			     segment->address);
+		total += segment->size;
+		if (verbose)
+			printf(" Segment 0x%08x-0x%08x, size %u\n",
+			       segment->address,
+			       segment->address + segment->size - 1,
+			       segment->size);
+	}
+	printf("%s file with %i segments, %llu bytes\n",
+	       dfu_image_format_name(format), file->segment_count,
+	       (unsigned long long)total);
+	return format;
+}
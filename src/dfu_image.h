@@ -0,0 +1,16 @@
+#ifndef DFU_IMAGE_H
+#define DFU_IMAGE_H
+
+#include "dfu_file.h"
+
+enum dfu_image_format {
+	IMAGE_BINARY,
+	IMAGE_IHEX,
+	IMAGE_SREC,
+	IMAGE_ELF
+};
+
+enum dfu_image_format dfu_image_parse(struct dfu_file *file);
+const char *dfu_image_format_name(enum dfu_image_format format);
+
+#endif /* DFU_IMAGE_H */
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 
 #include <libusb.h>
@@ -38,17 +39,235 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
+#include "dfu_async.h"
 #include "quirks.h"
 
+/* Bytes uploaded per probed transfer size, for a usable timing */
+#define PROBE_BYTES 16384
+/* DFU_GETSTATUS requests timed for the round trip of --benchmark */
+#define BENCHMARK_POLLS 200
+
+/* Brings the device back to dfuIDLE after a probe upload, which may
+ * have been stalled */
+static void dfuload_probe_recover(struct dfu_if *dif)
+{
+	struct dfu_status dst;
+
+	if (dfu_get_status(dif, &dst) < 0)
+		errx(EX_IOERR, "Error during probe get_status");
+	if (dst.bState == DFU_STATE_dfuERROR &&
+	    dfu_clear_status(dif->dev_handle, dif->interface) < 0)
+		errx(EX_IOERR, "Error clearing status after probe");
+	dfu_abort_to_idle(dif);
+}
+
+/* Uploads PROBE_BYTES in transfers of the given size and returns the
+ * throughput in bytes/s, or 0 if the size stalls, fails or comes back
+ * short. DfuSe devices read from their current address pointer, and
+ * step block addresses by their own transfer size, so small transfers
+ * would soon run past the end of memory. They re-read the first block */
+static unsigned long long dfuload_time_upload(struct dfu_if *dif,
+    unsigned char *buf, int size, int dfuse)
+{
+	unsigned short transaction = dfuse ? 2 : 0;
+	unsigned long long start = dfu_time_ms();
+	unsigned long long elapsed;
+	int bytes = 0;
+
+	while (bytes < PROBE_BYTES) {
+		int rc = dfu_upload(dif->dev_handle, dif->interface,
+		    size, dfuse ? transaction : transaction++, buf);
+
+		if (rc < 0 || (rc < size && bytes == 0)) {
+			if (verbose)
+				printf("Transfer size %i refused (%s)\n",
+				    size, rc < 0 ? libusb_error_name(rc) :
+				    "short transfer");
+			dfuload_probe_recover(dif);
+			return 0;
+		}
+		bytes += rc;
+		/* end of readable data, go with what we have */
+		if (rc < size)
+			break;
+	}
+	elapsed = dfu_time_ms() - start;
+	dfuload_probe_recover(dif);
+	return bytes * 1000ULL / (elapsed ? elapsed : 1);
+}
+
+/* The largest size within 5% of the best throughput, or 0 */
+static int dfuload_best_size(const int *sizes,
+    const unsigned long long *rates, int count)
+{
+	unsigned long long best_rate = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (rates[i] > best_rate)
+			best_rate = rates[i];
+	for (i = count - 1; i >= 0; i--)
+		if (rates[i] * 100 >= best_rate * 95)
+			return sizes[i];
+	return 0;
+}
+
+/* Times uploads with doubling transfer sizes from min_size up to max_size.
+ * Uploads do not change device memory, and DfuSe devices read from their
+ * current address pointer. The probe stops at the first size that stalls,
+ * fails or comes back short, and returns the largest size within 5% of
+ * the best throughput seen, or 0 if no size could be used */
+int dfuload_probe_xfer_size(struct dfu_if *dif, int min_size, int max_size,
+    int dfuse)
+{
+	unsigned char *buf;
+	unsigned long long rates[17];
+	int sizes[17];
+	int probed = 0;
+	int size;
+
+	if (!(dif->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)) {
+		warnx("Device can not upload, transfer size not probed");
+		return 0;
+	}
+	if (min_size < 1)
+		min_size = 64;
+
+	buf = dfu_malloc(max_size);
+	for (size = min_size; size <= max_size && probed < 17; size *= 2) {
+		rates[probed] = dfuload_time_upload(dif, buf, size, dfuse);
+		if (!rates[probed])
+			break;
+		sizes[probed] = size;
+		if (verbose)
+			printf("Transfer size %i: %llu bytes/s\n", size,
+			    rates[probed]);
+		probed++;
+	}
+	free(buf);
+
+	return dfuload_best_size(sizes, rates, probed);
+}
+
+/* Measures the DFU_GETSTATUS round trip, and the upload throughput at
+ * transfer sizes doubling from the control endpoint size up to max_size */
+void dfuload_benchmark_link(struct dfu_if *dif, int max_size, int dfuse,
+    struct dfu_benchmark *bench)
+{
+	struct dfu_status dst;
+	unsigned long long start;
+	unsigned long long rates[17];
+	unsigned char *buf;
+	int sizes[17];
+	int probed = 0;
+	int size;
+	int i;
+
+	start = dfu_time_ms();
+	for (i = 0; i < BENCHMARK_POLLS; i++)
+		if (dfu_get_status(dif, &dst) < 0)
+			errx(EX_IOERR, "Error during benchmark get_status");
+	bench->rtt_us = (dfu_time_ms() - start) * 1000 / BENCHMARK_POLLS;
+	printf("GETSTATUS round trip %u us\n", bench->rtt_us);
+
+	if (!(dif->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)) {
+		printf("Device can not upload, throughput not measured\n");
+		return;
+	}
+
+	buf = dfu_malloc(max_size);
+	size = dif->bMaxPacketSize0 ? dif->bMaxPacketSize0 : 64;
+	if (size > max_size)
+		size = max_size;
+	while (probed < 17) {
+		rates[probed] = dfuload_time_upload(dif, buf, size, dfuse);
+		if (!rates[probed]) {
+			printf("Upload with transfer size %5i refused\n",
+			    size);
+			break;
+		}
+		sizes[probed] = size;
+		printf("Upload with transfer size %5i: %8llu bytes/s\n",
+		    size, rates[probed]);
+		if (rates[probed] > bench->upload_rate)
+			bench->upload_rate = rates[probed];
+		probed++;
+		if (size == max_size)
+			break;
+		size = size * 2 > max_size ? max_size : size * 2;
+	}
+	free(buf);
+
+	bench->xfer_size = dfuload_best_size(sizes, rates, probed);
+}
+
+/* Prints what the benchmark suggests for transfer size and polling */
+void dfuload_benchmark_summary(const struct dfu_benchmark *bench)
+{
+	unsigned int busy = bench->erase_ms + bench->program_ms;
+	unsigned int asked = bench->erase_poll_ms + bench->program_poll_ms;
+	unsigned long long page_ms;
+
+	printf("\nBenchmark summary:\n");
+	printf("  GETSTATUS round trip     %u us\n", bench->rtt_us);
+	if (bench->xfer_size) {
+		printf("  Best upload throughput   %llu bytes/s\n",
+		    bench->upload_rate);
+		printf("  Suggested transfer size  %i (-t %i)\n",
+		    bench->xfer_size, bench->xfer_size);
+	}
+	if (!bench->page_size) {
+		printf("  Flash timing not measured, polling can not be "
+		    "judged\n");
+		return;
+	}
+
+	printf("  Page erase               %u ms, device asks to wait "
+	    "%u ms\n", bench->erase_ms, bench->erase_poll_ms);
+	printf("  Page program             %u ms in %i transfers, device "
+	    "asks to wait %u ms\n", bench->program_ms,
+	    bench->program_chunks, bench->program_poll_ms);
+	/* every transfer costs a download and at least two status polls */
+	page_ms = busy + (unsigned long long)bench->rtt_us *
+	    (1 + 3 * bench->program_chunks) / 1000;
+	printf("  Flash download estimate  %llu bytes/s\n",
+	    bench->page_size * 1000ULL / (page_ms ? page_ms : 1));
+
+	if (asked > busy + busy / 4 + 1)
+		printf("  Suggested polling        adaptive (-P), the device "
+		    "asks for %u ms more per page than it needs\n",
+		    asked - busy);
+	else if (busy > asked + asked / 4 + 1)
+		printf("  Suggested polling        default, the device is "
+		    "busy longer than it asks to wait and is polled "
+		    "again\n");
+	else
+		printf("  Suggested polling        default, the device asks "
+		    "for about as long as it needs\n");
+}
+
+/* Benchmark of a plain DFU device, which can not address its flash */
+int dfuload_do_benchmark(struct dfu_if *dif, int max_size)
+{
+	struct dfu_benchmark bench;
+
+	memset(&bench, 0, sizeof(bench));
+	dfuload_benchmark_link(dif, max_size, 0, &bench);
+	dfuload_benchmark_summary(&bench);
+	return 0;
+}
+
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
     int expected_size, int fd)
 {
 	int total_bytes = 0;
 	unsigned short transaction = 0;
 	unsigned char *buf;
+	struct dfu_sink *sink;
 	int ret;
 
 	buf = dfu_malloc(xfer_size);
+	sink = dfu_sink_open(fd);
 
 	printf("Copying data from DFU device to PC\n");
 	dfu_progress_bar("Upload", 0, 1);
@@ -63,7 +282,7 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
 			goto out_free;
 		}
 
-		dfu_file_write_crc(fd, 0, buf, rc);
+		dfu_sink_write(sink, buf, rc);
 		total_bytes += rc;
 
 		if (total_bytes < 0)
@@ -79,6 +298,7 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
 	ret = 0;
 
 out_free:
+	dfu_sink_close(sink);
 	dfu_progress_bar("Upload", total_bytes, total_bytes);
 	if (total_bytes == 0)
 		printf("\nFailed.\n");
@@ -97,6 +317,10 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 	unsigned char *buf;
 	unsigned short transaction = 0;
 	struct dfu_status dst;
+	struct dfu_poll poll;
+	struct dfu_pipe *pipe;
+	unsigned long long start_time;
+	unsigned char *stream_buf = NULL;
 	int ret;
 
 	printf("Copying data from PC to DFU device\n");
@@ -104,6 +328,14 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 	buf = file->firmware;
 	expected_size = file->size.total - file->size.suffix;
 	bytes_sent = 0;
+	if (file->source) {
+		/* the size is only known at the end of the stream */
+		stream_buf = dfu_malloc(xfer_size);
+		expected_size = INT_MAX;
+	}
+
+	pipe = dfu_pipe_open(dif, xfer_size);
+	start_time = dfu_time_ms();
 
 	dfu_progress_bar("Download", 0, 1);
 	while (bytes_sent < expected_size) {
@@ -115,6 +347,28 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 			chunk_size = bytes_left;
 		else
 			chunk_size = xfer_size;
+		if (file->source) {
+			chunk_size = dfu_source_read(file->source, stream_buf,
+						     xfer_size);
+			if (chunk_size == 0)
+				break;
+			buf = stream_buf;
+		}
+
+		if (pipe) {
+			/* status is checked when the next request goes out */
+			ret = dfu_pipe_dnload(pipe, DFU_OP_WRITE,
+					      transaction++, buf, chunk_size);
+			if (ret < 0) {
+				warnx("Error during download");
+				goto out;
+			}
+			bytes_sent += chunk_size;
+			buf += chunk_size;
+			dfu_progress_bar("Download", bytes_sent, stream_buf ?
+					 0 : bytes_sent + bytes_left);
+			continue;
+		}
 
 		ret = dfu_download(dif->dev_handle, dif->interface,
 		    chunk_size, transaction++, chunk_size ? buf : NULL);
@@ -125,19 +379,23 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 		bytes_sent += chunk_size;
 		buf += chunk_size;
 
+		dfu_poll_start(&poll, DFU_OP_WRITE);
 		do {
+			unsigned int wait;
+
 			ret = dfu_get_status(dif, &dst);
 			if (ret < 0) {
 				errx(EX_IOERR, "Error during download get_status");
 				goto out;
 			}
 
+			wait = dfu_poll_next(&poll, &dst);
 			if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
 					dst.bState == DFU_STATE_dfuERROR)
 				break;
 
 			/* Wait while device executes flashing */
-			milli_sleep(dst.bwPollTimeout);
+			milli_sleep(wait);
 
 		} while (1);
 		if (dst.bStatus != DFU_STATUS_OK) {
@@ -148,9 +406,24 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 			ret = -1;
 			goto out;
 		}
-		dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
+		dfu_progress_bar("Download", bytes_sent,
+				 stream_buf ? 0 : bytes_sent + bytes_left);
 	}
 
+	if (pipe) {
+		ret = dfu_pipe_flush(pipe, &dst);
+		dfu_pipe_close(pipe);
+		pipe = NULL;
+		if (ret < 0) {
+			warnx("Error during download");
+			goto out;
+		}
+	}
+
+	/* the suffix of a stream is only seen now */
+	if (file->source)
+		dfu_source_finish(file);
+
 	/* send one zero sized download request to signalize end */
 	ret = dfu_download(dif->dev_handle, dif->interface,
 	    0, transaction, NULL);
@@ -162,7 +435,9 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 	dfu_progress_bar("Download", bytes_sent, bytes_sent);
 
 	if (verbose)
-		printf("Sent a total of %i bytes\n", bytes_sent);
+		printf("Sent a total of %i bytes in %llu ms\n", bytes_sent,
+		       dfu_time_ms() - start_time);
+	dfu_poll_report();
 
 get_status:
 	/* Transition to MANIFEST_SYNC state */
@@ -192,5 +467,7 @@ get_status:
 	printf("Done!\n");
 
 out:
+	dfu_pipe_close(pipe);
+	free(stream_buf);
 	return bytes_sent;
 }
@@ -1,7 +1,26 @@
 #ifndef DFU_LOAD_H
 #define DFU_LOAD_H
 
+/* Results of --benchmark, flash timings are 0 unless measured */
+struct dfu_benchmark {
+	unsigned int rtt_us;		/* DFU_GETSTATUS round trip */
+	int xfer_size;			/* suggested, from uploads */
+	unsigned long long upload_rate;	/* best, in bytes/s */
+	unsigned int page_size;
+	unsigned int erase_ms;		/* busy time of a page erase */
+	unsigned int erase_poll_ms;	/* bwPollTimeout reported for it */
+	unsigned int program_ms;	/* busy time of programming a page */
+	unsigned int program_poll_ms;	/* summed over its transfers */
+	int program_chunks;
+};
+
+int dfuload_probe_xfer_size(struct dfu_if *dif, int min_size, int max_size,
+    int dfuse);
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size, int expected_size, int fd);
 int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file);
+void dfuload_benchmark_link(struct dfu_if *dif, int max_size, int dfuse,
+    struct dfu_benchmark *bench);
+void dfuload_benchmark_summary(const struct dfu_benchmark *bench);
+int dfuload_do_benchmark(struct dfu_if *dif, int max_size);
 
 #endif /* DFU_LOAD_H */
@@ -37,6 +37,13 @@
 #include "dfuse.h"
 #include "quirks.h"
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* Time a device may take to answer the requests made while probing it */
+#define PROBE_BUDGET_MS 3000
+
 /*
  * Look for a descriptor in a concatenated descriptor list. Will
  * return upon the first match of the given descriptor type. Returns length of
@@ -71,29 +78,117 @@ static int find_descriptor(const uint8_t *desc_list, int list_len,
 	return -1;
 }
 
-static void probe_configuration(libusb_device *dev, struct libusb_device_descriptor *desc)
+/* Per device state while probing its configurations. The device is only
+ * opened once, and only when a string descriptor or the DFU functional
+ * descriptor has to be read from it */
+struct probe_dev {
+	libusb_device *dev;
+	struct libusb_device_descriptor *desc;
+	libusb_device_handle *devh;
+	unsigned long long deadline;
+	int over_budget;
+	int open_failed;
+	int have_serial;
+	char serial_name[MAX_DESC_STR_LEN + 1];
+};
+
+/* Checks that there is time left for another request to the device */
+static int probe_budget(struct probe_dev *pd)
+{
+	if (!pd->over_budget && dfu_time_ms() > pd->deadline) {
+		pd->over_budget = 1;
+		warnx("Device %04x:%04x is not responding in time, "
+		      "skipping further requests", pd->desc->idVendor,
+		      pd->desc->idProduct);
+	}
+	return !pd->over_budget;
+}
+
+static libusb_device_handle *probe_open(struct probe_dev *pd)
+{
+	if (!pd->devh && !pd->open_failed && probe_budget(pd) &&
+	    libusb_open(pd->dev, &pd->devh)) {
+		pd->devh = NULL;
+		pd->open_failed = 1;
+		warnx("Cannot open DFU device %04x:%04x",
+		      pd->desc->idVendor, pd->desc->idProduct);
+	}
+	return pd->devh;
+}
+
+static const char *probe_serial(struct probe_dev *pd)
+{
+	struct libusb_device_descriptor *desc = pd->desc;
+	char *serial_name = pd->serial_name;
+	int ret = -1;
+
+	if (pd->have_serial)
+		return serial_name;
+	pd->have_serial = 1;
+
+	if (desc->iSerialNumber != 0 && probe_open(pd) && probe_budget(pd))
+	{
+		if (desc->idVendor == 0x28e9 && desc->idProduct == 0x0189)
+		/* GD32 uses serial number to indicate device model */
+		{
+			ret = libusb_get_string_descriptor(pd->devh, desc->iSerialNumber,
+				0x0409, (void *)serial_name, MAX_DESC_STR_LEN);
+			int k;
+			for(k = 2; k <= ret; k++)
+				serial_name[k - 2] = serial_name[k];
+		}
+		else
+		{
+			ret = libusb_get_string_descriptor_ascii(pd->devh,
+				desc->iSerialNumber, (void *)serial_name, MAX_DESC_STR_LEN);
+		}
+	}
+	if (ret < 1)
+		strcpy(serial_name, "UNKNOWN");
+	return serial_name;
+}
+
+static void probe_alt_name(struct probe_dev *pd,
+    const struct libusb_interface_descriptor *intf, char *alt_name)
+{
+	int ret = -1;
+
+	if (intf->iInterface != 0 && probe_open(pd) && probe_budget(pd))
+		ret = libusb_get_string_descriptor_ascii(pd->devh,
+		    intf->iInterface, (void *)alt_name, MAX_DESC_STR_LEN);
+	if (ret < 1)
+		strcpy(alt_name, "UNKNOWN");
+}
+
+/* Adds the matching DFU interfaces of a device in front of *list */
+static void probe_configuration(libusb_device *dev,
+    struct libusb_device_descriptor *desc, struct dfu_if **list)
 {
 	struct usb_dfu_func_descriptor func_dfu;
-	libusb_device_handle *devh;
+	struct probe_dev pd;
 	struct dfu_if *pdfu;
 	struct libusb_config_descriptor *cfg;
 	const struct libusb_interface_descriptor *intf;
 	const struct libusb_interface *uif;
 	char alt_name[MAX_DESC_STR_LEN + 1];
-	char serial_name[MAX_DESC_STR_LEN + 1];
 	int cfg_idx;
 	int intf_idx;
 	int alt_idx;
 	int ret;
 	int has_dfu;
 
+	memset(&pd, 0, sizeof(pd));
+	pd.dev = dev;
+	pd.desc = desc;
+	pd.deadline = dfu_time_ms() + PROBE_BUDGET_MS;
+
 	for (cfg_idx = 0; cfg_idx != desc->bNumConfigurations; cfg_idx++) {
 		memset(&func_dfu, 0, sizeof(func_dfu));
 		has_dfu = 0;
 
 		ret = libusb_get_config_descriptor(dev, cfg_idx, &cfg);
 		if (ret != 0)
-			return;
+			break;
 		if (match_config_index > -1 && match_config_index != cfg->bConfigurationValue) {
 			libusb_free_config_descriptor(cfg);
 			continue;
@@ -104,7 +199,7 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 		 * the configuration descriptors are empty
 		 */
 		if (!cfg)
-			return;
+			break;
 
 		ret = find_descriptor(cfg->extra, cfg->extra_length,
 		    USB_DT_DFU, &func_dfu, sizeof(func_dfu));
@@ -139,10 +234,9 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 			 * device directly This is not supported on
 			 * all devices for non-standard types
 			 */
-			if (libusb_open(dev, &devh) == 0) {
-				ret = libusb_get_descriptor(devh, USB_DT_DFU, 0,
+			if (probe_open(&pd)) {
+				ret = libusb_get_descriptor(pd.devh, USB_DT_DFU, 0,
 				    (void *)&func_dfu, sizeof(func_dfu));
-				libusb_close(devh);
 				if (ret > -1)
 					goto found_dfu;
 			}
@@ -182,6 +276,7 @@ found_dfu:
 
 			for (alt_idx = 0;
 			     alt_idx < uif->num_altsetting; alt_idx++) {
+				const char *match_serial_mode;
 				int dfu_mode;
 
 				intf = &uif->altsetting[alt_idx];
@@ -215,51 +310,19 @@ found_dfu:
 					}
 				}
 
-				if (libusb_open(dev, &devh)) {
-					warnx("Cannot open DFU device %04x:%04x", desc->idVendor, desc->idProduct);
+				/* only string filters left, which need the device opened */
+				if (!probe_open(&pd))
 					break;
-				}
-				if (intf->iInterface != 0)
-					ret = libusb_get_string_descriptor_ascii(devh,
-					    intf->iInterface, (void *)alt_name, MAX_DESC_STR_LEN);
-				else
-					ret = -1;
-				if (ret < 1)
-					strcpy(alt_name, "UNKNOWN");
-				if (desc->iSerialNumber != 0)
-				{
-					if (desc->idVendor == 0x28e9 && desc->idProduct == 0x0189)
-					/* GD32 uses serial number to indicate device model */
-					{
-						ret = libusb_get_string_descriptor(devh, desc->iSerialNumber,
-							0x0409, (void *)serial_name, MAX_DESC_STR_LEN);
-						int k;
-						for(k = 2; k <= ret; k++)
-							serial_name[k - 2] = serial_name[k];
-					}
-					else
-					{
-						ret = libusb_get_string_descriptor_ascii(devh,
-							desc->iSerialNumber, (void *)serial_name, MAX_DESC_STR_LEN);
-					}
-				}
-				else
-					ret = -1;
-				if (ret < 1)
-					strcpy(serial_name, "UNKNOWN");
-				libusb_close(devh);
 
+				probe_alt_name(&pd, intf, alt_name);
 				if (dfu_mode &&
 				    match_iface_alt_name != NULL && strcmp(alt_name, match_iface_alt_name))
 					continue;
 
-				if (dfu_mode) {
-					if (match_serial_dfu != NULL && strcmp(match_serial_dfu, serial_name))
-						continue;
-				} else {
-					if (match_serial != NULL && strcmp(match_serial, serial_name))
-						continue;
-				}
+				match_serial_mode = dfu_mode ? match_serial_dfu : match_serial;
+				if (match_serial_mode != NULL &&
+				    strcmp(match_serial_mode, probe_serial(&pd)))
+					continue;
 
 				pdfu = dfu_malloc(sizeof(*pdfu));
 
@@ -280,7 +343,7 @@ found_dfu:
 				pdfu->alt_name = strdup(alt_name);
 				if (pdfu->alt_name == NULL)
 					errx(EX_SOFTWARE, "Out of memory");
-				pdfu->serial_name = strdup(serial_name);
+				pdfu->serial_name = strdup(probe_serial(&pd));
 				if (pdfu->serial_name == NULL)
 					errx(EX_SOFTWARE, "Out of memory");
 				if (dfu_mode)
@@ -292,12 +355,14 @@ found_dfu:
 				pdfu->bMaxPacketSize0 = desc->bMaxPacketSize0;
 
 				/* queue into list */
-				pdfu->next = dfu_root;
-				dfu_root = pdfu;
+				pdfu->next = *list;
+				*list = pdfu;
 			}
 		}
 		libusb_free_config_descriptor(cfg);
 	}
+	if (pd.devh)
+		libusb_close(pd.devh);
 }
 
 #define MAX_PATH_LEN 20
@@ -307,6 +372,7 @@ char *get_path(libusb_device *dev)
 {
 	uint8_t path[8];
 	int r,j;
+	path_buf[0] = 0;
 	r = libusb_get_port_numbers(dev, path, sizeof(path));
 	if (r > 0) {
 		sprintf(path_buf,"%d-%d",libusb_get_bus_number(dev),path[0]);
@@ -317,26 +383,241 @@ char *get_path(libusb_device *dev)
 	return path_buf;
 }
 
+/* The candidate devices on one bus, probed by one thread */
+struct probe_bus {
+	uint8_t busnum;
+	int *devices;		/* indexes into the device list */
+	int count;
+	libusb_device **list;
+	struct libusb_device_descriptor *descs;
+	struct dfu_if **found;	/* interfaces found, per device index */
+#ifdef HAVE_PTHREAD_H
+	pthread_t thread;
+	int threaded;
+#endif
+};
+
+static void *probe_bus_devices(void *arg)
+{
+	struct probe_bus *bus = arg;
+	int i;
+
+	for (i = 0; i < bus->count; i++) {
+		int d = bus->devices[i];
+
+		probe_configuration(bus->list[d], &bus->descs[d],
+		    &bus->found[d]);
+	}
+	return NULL;
+}
+
+/* Probes the devices of every bus in a thread of its own, so that a slow
+ * device only holds up its own bus. The result is merged in device list
+ * order, the same as when probing one device after another */
 void probe_devices(libusb_context *ctx)
 {
 	libusb_device **list;
+	struct libusb_device_descriptor *descs;
+	struct dfu_if **found;
+	struct probe_bus *buses;
+	int nbuses = 0;
 	ssize_t num_devs;
 	ssize_t i;
+	int b;
 
 	num_devs = libusb_get_device_list(ctx, &list);
+	if (num_devs < 0)
+		return;
+
+	descs = dfu_malloc((num_devs + 1) * sizeof(*descs));
+	found = dfu_malloc((num_devs + 1) * sizeof(*found));
+	buses = dfu_malloc((num_devs + 1) * sizeof(*buses));
+	memset(found, 0, (num_devs + 1) * sizeof(*found));
+	memset(buses, 0, (num_devs + 1) * sizeof(*buses));
+
 	for (i = 0; i < num_devs; ++i) {
-		struct libusb_device_descriptor desc;
+		struct libusb_device_descriptor *desc = &descs[i];
 		struct libusb_device *dev = list[i];
+		uint8_t busnum;
 
 		if (match_path != NULL && strcmp(get_path(dev),match_path) != 0)
 			continue;
-		if (libusb_get_device_descriptor(dev, &desc))
+		if (libusb_get_device_descriptor(dev, desc))
+			continue;
+		/* neither the run-time nor the DFU mode IDs can match */
+		if (((match_vendor >= 0 && match_vendor != desc->idVendor) ||
+		     (match_product >= 0 && match_product != desc->idProduct)) &&
+		    ((match_vendor_dfu >= 0 && match_vendor_dfu != desc->idVendor) ||
+		     (match_product_dfu >= 0 && match_product_dfu != desc->idProduct)))
+			continue;
+
+		busnum = libusb_get_bus_number(dev);
+		for (b = 0; b < nbuses; b++)
+			if (buses[b].busnum == busnum)
+				break;
+		if (b == nbuses) {
+			buses[b].busnum = busnum;
+			buses[b].devices = dfu_malloc(num_devs *
+			    sizeof(*buses[b].devices));
+			buses[b].list = list;
+			buses[b].descs = descs;
+			buses[b].found = found;
+			nbuses++;
+		}
+		buses[b].devices[buses[b].count++] = i;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (nbuses > 1) {
+		for (b = 0; b < nbuses; b++)
+			buses[b].threaded = !pthread_create(&buses[b].thread,
+			    NULL, probe_bus_devices, &buses[b]);
+		for (b = 0; b < nbuses; b++) {
+			if (buses[b].threaded)
+				pthread_join(buses[b].thread, NULL);
+			else
+				probe_bus_devices(&buses[b]);
+		}
+	} else
+#endif
+	for (b = 0; b < nbuses; b++)
+		probe_bus_devices(&buses[b]);
+
+	for (i = 0; i < num_devs; i++) {
+		struct dfu_if *last = found[i];
+
+		if (!last)
 			continue;
-		probe_configuration(dev, &desc);
+		while (last->next)
+			last = last->next;
+		last->next = dfu_root;
+		dfu_root = found[i];
 	}
+
+	for (b = 0; b < nbuses; b++)
+		free(buses[b].devices);
+	free(buses);
+	free(found);
+	free(descs);
 	libusb_free_device_list(list, 0);
 }
 
+/* Checks descriptors only for an interface in DFU mode, as seen by
+ * probe_configuration(). Run-time interfaces have bInterfaceProtocol 1 */
+static int has_dfu_mode_interface(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *cfg;
+	int cfg_idx;
+	int intf_idx;
+	int alt_idx;
+	int found = 0;
+
+	if (libusb_get_device_descriptor(dev, &desc))
+		return 0;
+	for (cfg_idx = 0; cfg_idx != desc.bNumConfigurations && !found;
+	     cfg_idx++) {
+		if (libusb_get_config_descriptor(dev, cfg_idx, &cfg) || !cfg)
+			continue;
+		for (intf_idx = 0; intf_idx < cfg->bNumInterfaces; intf_idx++) {
+			const struct libusb_interface *uif =
+			    &cfg->interface[intf_idx];
+
+			for (alt_idx = 0; alt_idx < uif->num_altsetting;
+			     alt_idx++) {
+				const struct libusb_interface_descriptor *intf =
+				    &uif->altsetting[alt_idx];
+
+				if (intf->bInterfaceClass != 0xfe ||
+				    intf->bInterfaceSubClass != 1)
+					continue;
+				/* LPC DFU bootloader, see probe_configuration() */
+				if (intf->bInterfaceProtocol != 1 ||
+				    (desc.idVendor == 0x1fc9 &&
+				     desc.idProduct == 0x000c))
+					found = 1;
+			}
+		}
+		libusb_free_config_descriptor(cfg);
+	}
+	return found;
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+struct dfu_arrival {
+	const char *path;
+	int arrived;
+};
+
+static int LIBUSB_CALL dfu_arrival_cb(libusb_context *ctx,
+    libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	struct dfu_arrival *arrival = user_data;
+
+	(void)ctx;
+	(void)event;
+	if (!strcmp(get_path(dev), arrival->path) &&
+	    has_dfu_mode_interface(dev))
+		arrival->arrived = 1;
+	return 0;
+}
+#endif
+
+/* Waits up to timeout_ms for a device in DFU mode to show up on a port
+ * path, using hotplug events where libusb supports them and polling the
+ * device list otherwise. Returns 1 if it did, 0 on timeout */
+int wait_dfu_device(libusb_context *ctx, const char *path, int timeout_ms)
+{
+	unsigned long long deadline = dfu_time_ms() + timeout_ms;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		struct dfu_arrival arrival = { path, 0 };
+		libusb_hotplug_callback_handle handle;
+
+		/* enumerate too, the device may already be back */
+		if (libusb_hotplug_register_callback(ctx,
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+		    LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+		    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		    dfu_arrival_cb, &arrival, &handle) == 0) {
+			while (!arrival.arrived) {
+				unsigned long long now = dfu_time_ms();
+				struct timeval tv;
+
+				if (now >= deadline)
+					break;
+				tv.tv_sec = (deadline - now) / 1000;
+				tv.tv_usec = ((deadline - now) % 1000) * 1000;
+				libusb_handle_events_timeout_completed(ctx,
+				    &tv, &arrival.arrived);
+			}
+			libusb_hotplug_deregister_callback(ctx, handle);
+			return arrival.arrived;
+		}
+	}
+#endif
+	while (1) {
+		libusb_device **list;
+		ssize_t num_devs;
+		ssize_t i;
+		int found = 0;
+
+		num_devs = libusb_get_device_list(ctx, &list);
+		for (i = 0; i < num_devs && !found; i++)
+			if (!strcmp(get_path(list[i]), path) &&
+			    has_dfu_mode_interface(list[i]))
+				found = 1;
+		if (num_devs >= 0)
+			libusb_free_device_list(list, 1);
+		if (found)
+			return 1;
+		if (dfu_time_ms() >= deadline)
+			return 0;
+		milli_sleep(100);
+	}
+}
+
 void disconnect_devices(void)
 {
 	struct dfu_if *pdfu;
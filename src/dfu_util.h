@@ -11,7 +11,8 @@ enum mode {
 	MODE_LIST,
 	MODE_DETACH,
 	MODE_UPLOAD,
-	MODE_DOWNLOAD
+	MODE_DOWNLOAD,
+	MODE_BENCHMARK
 };
 
 extern struct dfu_if *dfu_root;
@@ -27,8 +28,10 @@ extern const char *match_iface_alt_name;
 extern const char *match_serial;
 extern const char *match_serial_dfu;
 
+char *get_path(libusb_device *dev);
 void probe_devices(libusb_context *);
 void disconnect_devices(void);
+int wait_dfu_device(libusb_context *ctx, const char *path, int timeout_ms);
 void print_dfu_if(struct dfu_if *);
 void list_dfu_interfaces(void);
 
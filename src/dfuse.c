@@ -26,26 +26,92 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 #include "portable.h"
 #include "dfu.h"
 #include "usb_dfu.h"
 #include "dfu_file.h"
+#include "dfu_load.h"
+#include "dfu_util.h"
 #include "dfuse.h"
 #include "dfuse_mem.h"
+#include "dfu_async.h"
 #include "quirks.h"
 
 #define DFU_TIMEOUT 5000
 
 extern int verbose;
-static unsigned int last_erased_page = 1; /* non-aligned value, won't match */
-static struct memsegment *mem_layout;
+static struct memlayout *mem_layout;
+static struct dfu_pipe *dfuse_pipe;
 static unsigned int dfuse_address = 0;
 static unsigned int dfuse_length = 0;
 static int dfuse_force = 0;
 static int dfuse_leave = 0;
 static int dfuse_unprotect = 0;
 static int dfuse_mass_erase = 0;
+static int dfuse_diff = 0;
+static int dfuse_run = 0;
+static int dfuse_all = 0;
+/* SET_ADDRESS before every chunk, for devices that ignore block numbers */
+static int dfuse_set_address = 0;
+/* Address pointer of the device, as last set by us */
+static unsigned int dfuse_pointer;
+static int dfuse_pointer_valid = 0;
+/* Address chunks by block number relative to the address pointer */
+static int dfuse_block_addressing = 0;
+static int dfuse_addresses_skipped = 0;
+/* Pages to erase before writing, see dfuse_plan_element() */
+static unsigned int *erase_plan;
+static int erase_plan_count = 0;
+static int erase_plan_size = 0;
+/* All erasable pages were mass erased in this session */
+static int dfuse_all_erased = 0;
+static int dfuse_blank_skipped = 0;
+/* Planned pages found unchanged by dfuse_diff_planned(), not written */
+static unsigned int *unchanged_pages;
+static int unchanged_pages_count = 0;
+
+/* A piece of the image, written to consecutive device memory */
+struct dfuse_element {
+	unsigned int address;
+	unsigned int size;
+	unsigned char *data;	/* points into the file buffer */
+};
+
+/* Index of a DfuSe file, built by dfuse_parse_file() */
+struct dfuse_target {
+	unsigned int alt;
+	char name[256];
+	struct dfuse_element *elements;
+	int element_count;
+};
+static struct dfuse_target *dfuse_targets;
+static int dfuse_target_count = 0;
+
+static void dfuse_free_targets(void)
+{
+	int i;
+
+	for (i = 0; i < dfuse_target_count; i++)
+		free(dfuse_targets[i].elements);
+	free(dfuse_targets);
+	dfuse_targets = NULL;
+	dfuse_target_count = 0;
+}
+
+/* The elements of a DfuSe file for one alternate setting */
+struct dfuse_pass {
+	unsigned int alt;
+	const char *name;
+	struct dfuse_element *elements;
+	int count;
+};
+
+/* Memory layouts of the alternate settings used in this session, each
+ * parsed once by dfuse_alt_layout() */
+static struct memlayout *dfuse_layouts[256];
+static unsigned int dfuse_current_alt;
 
 unsigned int quad2uint(unsigned char *p)
 {
@@ -102,6 +168,27 @@ void dfuse_parse_options(const char *options)
 			options += 10;
 			continue;
 		}
+		if (!strncmp(options, "diff", endword - options)) {
+			dfuse_diff = 1;
+			options += 4;
+			continue;
+		}
+		if (!strncmp(options, "all", endword - options)) {
+			dfuse_all = 1;
+			options += 3;
+			continue;
+		}
+		if (!strncmp(options, "set-address", endword - options)) {
+			dfuse_set_address = 1;
+			options += 11;
+			continue;
+		}
+		if (!strncmp(options, "run", endword - options)) {
+			dfuse_run = 1;
+			dfuse_leave = 1;
+			options += 3;
+			continue;
+		}
 
 		/* any valid number is interpreted as upload length */
 		number = strtoul(options, &end, 0);
@@ -120,7 +207,7 @@ int dfuse_upload(struct dfu_if *dif, const unsigned short length,
 {
 	int status;
 
-	status = libusb_control_transfer(dif->dev_handle,
+	status = dfu_transport->control(dif->dev_handle,
 		 /* bmRequestType */	 LIBUSB_ENDPOINT_IN |
 					 LIBUSB_REQUEST_TYPE_CLASS |
 					 LIBUSB_RECIPIENT_INTERFACE,
@@ -143,7 +230,7 @@ int dfuse_download(struct dfu_if *dif, const unsigned short length,
 {
 	int status;
 
-	status = libusb_control_transfer(dif->dev_handle,
+	status = dfu_transport->control(dif->dev_handle,
 		 /* bmRequestType */	 LIBUSB_ENDPOINT_OUT |
 					 LIBUSB_REQUEST_TYPE_CLASS |
 					 LIBUSB_RECIPIENT_INTERFACE,
@@ -160,6 +247,13 @@ int dfuse_download(struct dfu_if *dif, const unsigned short length,
 	return status;
 }
 
+/* Waits for requests queued on the asynchronous pipe, if any */
+static void dfuse_pipe_sync(void)
+{
+	if (dfuse_pipe && dfu_pipe_flush(dfuse_pipe, NULL) < 0)
+		errx(EX_IOERR, "Error during download");
+}
+
 /* DfuSe only commands */
 /* Leaves the device in dfuDNLOAD-IDLE state */
 int dfuse_special_command(struct dfu_if *dif, unsigned int address,
@@ -167,10 +261,14 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 {
 	const char* dfuse_command_name[] = { "SET_ADDRESS" , "ERASE_PAGE",
 					     "MASS_ERASE", "READ_UNPROTECT"};
+	/* READ_UNPROTECT is not polled until done */
+	const enum dfu_poll_op dfuse_poll_op[] = { DFU_OP_SET_ADDRESS,
+		DFU_OP_ERASE_PAGE, DFU_OP_MASS_ERASE, DFU_OP_MASS_ERASE };
 	unsigned char buf[5];
 	int length;
 	int ret;
 	struct dfu_status dst;
+	struct dfu_poll poll;
 	int firstpoll = 1;
 
 	if (command == ERASE_PAGE) {
@@ -186,10 +284,9 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 		if (verbose > 1)
 			printf("Erasing page size %i at address 0x%08x, page "
 			       "starting at 0x%08x\n", page_size, address,
-			       address & ~(page_size - 1));
+			       segment_page_start(segment, address));
 		buf[0] = 0x41;	/* Erase command */
 		length = 5;
-		last_erased_page = address & ~(page_size - 1);
 	} else if (command == SET_ADDRESS) {
 		if (verbose > 2)
 			printf("  Setting address pointer to 0x%08x\n",
@@ -210,11 +307,34 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 	buf[3] = (address >> 16) & 0xff;
 	buf[4] = (address >> 24) & 0xff;
 
+	if (dfuse_pipe) {
+		/* queue address changes in front of the chunk they are for,
+		 * everything else must wait for queued requests to finish */
+		if (command == SET_ADDRESS) {
+			ret = dfu_pipe_dnload(dfuse_pipe, DFU_OP_SET_ADDRESS,
+					      0, buf, length);
+			if (ret < 0)
+				errx(EX_IOERR, "Error during special command "
+				     "\"%s\" download",
+				     dfuse_command_name[command]);
+			dfuse_pointer = address;
+			dfuse_pointer_valid = 1;
+			return ret;
+		}
+		dfuse_pipe_sync();
+	}
+
+	/* Erase commands may move the address pointer too, so only trust
+	 * it after an explicit SET_ADDRESS */
+	dfuse_pointer = address;
+	dfuse_pointer_valid = (command == SET_ADDRESS);
+
 	ret = dfuse_download(dif, length, buf, 0);
 	if (ret < 0) {
 		errx(EX_IOERR, "Error during special command \"%s\" download",
 			dfuse_command_name[command]);
 	}
+	dfu_poll_start(&poll, dfuse_poll_op[command]);
 	do {
 		ret = dfu_get_status(dif, &dst);
 		if (ret < 0) {
@@ -239,9 +359,11 @@ int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 		/* wait while command is executed */
 		if (verbose)
 			printf("   Poll timeout %i ms\n", dst.bwPollTimeout);
-		milli_sleep(dst.bwPollTimeout);
-		if (command == READ_UNPROTECT)
+		if (command == READ_UNPROTECT) {
+			milli_sleep(dst.bwPollTimeout);
 			return ret;
+		}
+		milli_sleep(dfu_poll_next(&poll, &dst));
 	} while (dst.bState == DFU_STATE_dfuDNBUSY);
 
 	if (dst.bStatus != DFU_STATUS_OK) {
@@ -256,6 +378,7 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 {
 	int bytes_sent;
 	struct dfu_status dst;
+	struct dfu_poll poll;
 	int ret;
 
 	ret = dfuse_download(dif, size, size ? data : NULL, transaction);
@@ -265,13 +388,14 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 	}
 	bytes_sent = ret;
 
+	dfu_poll_start(&poll, DFU_OP_WRITE);
 	do {
 		ret = dfu_get_status(dif, &dst);
 		if (ret < 0) {
 			errx(EX_IOERR, "Error during download get_status");
 			return ret;
 		}
-		milli_sleep(dst.bwPollTimeout);
+		milli_sleep(dfu_poll_next(&poll, &dst));
 	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
 		 dst.bState != DFU_STATE_dfuERROR &&
 		 dst.bState != DFU_STATE_dfuMANIFEST);
@@ -289,28 +413,250 @@ int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 	return bytes_sent;
 }
 
+static struct memlayout *dfuse_alt_layout(struct dfu_if *dif,
+					  unsigned int alt)
+{
+	char name[MAX_DESC_STR_LEN + 1];
+	struct memlayout *layout;
+
+	if (dfuse_layouts[alt])
+		return dfuse_layouts[alt];
+	if ((dif->quirks & QUIRK_GD32) && alt == 0) {
+		printf("GD32 flash memory access detected\n");
+		layout = parse_memory_gd32(dif->serial_name);
+	} else if (alt == dif->altsetting) {
+		layout = parse_memory_layout((char *)dif->alt_name);
+	} else {
+		if (dfu_transport->get_alt_name(dif, alt, name,
+						sizeof(name)) < 0)
+			errx(EX_IOERR, "Cannot read name of alternate "
+			     "setting %i", alt);
+		if (verbose)
+			printf("Alternate setting %i is \"%s\"\n", alt, name);
+		layout = parse_memory_layout(name);
+	}
+	if (!layout)
+		errx(EX_IOERR, "Failed to parse memory layout of alternate "
+		     "setting %i", alt);
+	dfuse_layouts[alt] = layout;
+	return layout;
+}
+
+static void dfuse_free_layouts(void)
+{
+	unsigned int alt;
+
+	for (alt = 0; alt < 256; alt++) {
+		free_memory_layout(dfuse_layouts[alt]);
+		dfuse_layouts[alt] = NULL;
+	}
+}
+
+/*
+ * Points the device at readable memory for timing uploads: the start of
+ * the segment holding address if that is readable, as the address may be
+ * close to its end, or else the first readable segment. Returns -1 if
+ * the layout has no readable memory.
+ */
+int dfuse_point_readable(struct dfu_if *dif, unsigned int address)
+{
+	struct memlayout *layout = dfuse_alt_layout(dif, dif->altsetting);
+	struct memsegment *segment = NULL;
+	int i;
+
+	if (address)
+		segment = find_segment(layout, address);
+	if (!segment || !(segment->memtype & DFUSE_READABLE)) {
+		segment = NULL;
+		for (i = 0; i < layout->count && !segment; i++)
+			if (layout->segments[i].memtype & DFUSE_READABLE)
+				segment = &layout->segments[i];
+	}
+	if (!segment)
+		return -1;
+	mem_layout = layout;
+	dfuse_special_command(dif, segment->start, SET_ADDRESS);
+	dfu_abort_to_idle(dif);
+	return 0;
+}
+
+/* Switches the interface to another alternate setting, so that all
+ * following requests go to its memory. The device must be idle first */
+static void dfuse_select_alt(struct dfu_if *dif, unsigned int alt)
+{
+	if (alt == dfuse_current_alt)
+		return;
+	dfuse_pipe_sync();
+	dfu_abort_to_idle(dif);
+	if (dfu_transport->set_alt(dif->dev_handle, dif->interface, alt) < 0)
+		errx(EX_IOERR, "Cannot set alternate setting %i", alt);
+	if (verbose)
+		printf("Switched to alternate setting %i\n", alt);
+	dfuse_current_alt = alt;
+	mem_layout = dfuse_alt_layout(dif, alt);
+	/* the address pointer and the mass erase belong to the old one */
+	dfuse_pointer_valid = 0;
+	dfuse_all_erased = 0;
+}
+
+/*
+ * Uploads length bytes from address on to the sink. The address pointer
+ * must have been set to address before. Block numbers are 16 bits, so
+ * the range is read in windows of 0x4000 blocks, each with its own
+ * SET_ADDRESS. Returns the number of bytes read, which is less if the
+ * device ends the upload early, or a negative error.
+ */
+static int dfuse_upload_range(struct dfu_if *dif, int xfer_size,
+			      unsigned char *buf, struct dfu_sink *sink,
+			      unsigned int address, int length, int done,
+			      int total)
+{
+	int total_bytes = 0;
+	int transaction = 2;
+
+	while (1) {
+		int rc;
+
+		if (transaction == 2 + 0x4000) {
+			dfu_abort_to_idle(dif);
+			dfuse_special_command(dif, address + total_bytes,
+					      SET_ADDRESS);
+			dfu_abort_to_idle(dif);
+			transaction = 2;
+		}
+		/* last chunk can be smaller than original xfer_size */
+		if (length - total_bytes < xfer_size)
+			xfer_size = length - total_bytes;
+		rc = dfuse_upload(dif, xfer_size, buf, transaction++);
+		if (rc < 0)
+			return rc;
+
+		dfu_sink_write(sink, buf, rc);
+		total_bytes += rc;
+
+		if (total_bytes < 0)
+			errx(EX_SOFTWARE, "Received too many bytes");
+
+		if (rc < xfer_size || total_bytes >= length) {
+			/* last block, return successfully */
+			break;
+		}
+		dfu_progress_bar("Upload", done + total_bytes, total);
+	}
+	return total_bytes;
+}
+
+/* A run of adjacent readable segments, uploaded as one range */
+struct dfuse_range {
+	unsigned int start;
+	unsigned int size;
+};
+
+/*
+ * Uploads all readable memory of the layout in address order. Adjacent
+ * segments are merged into one range, so that the address pointer is
+ * only set once per gap. The ranges are written back to back.
+ */
+static int dfuse_upload_all(struct dfu_if *dif, int xfer_size,
+			    unsigned char *buf, struct dfu_sink *sink)
+{
+	struct dfuse_range *ranges;
+	unsigned long long total = 0;
+	int range_count = 0;
+	int total_bytes = 0;
+	int i;
+
+	if (mem_layout->count == 0)
+		errx(EX_IOERR, "No readable memory in the memory layout");
+	ranges = dfu_malloc(mem_layout->count * sizeof(*ranges));
+	for (i = 0; i < mem_layout->count; i++) {
+		struct memsegment *segment = &mem_layout->segments[i];
+
+		if (!(segment->memtype & DFUSE_READABLE))
+			continue;
+		if (range_count && ranges[range_count - 1].start +
+		    ranges[range_count - 1].size == segment->start)
+			ranges[range_count - 1].size += segment->end -
+			    segment->start + 1;
+		else {
+			ranges[range_count].start = segment->start;
+			ranges[range_count].size = segment->end -
+			    segment->start + 1;
+			range_count++;
+		}
+		total += segment->end - segment->start + 1;
+	}
+	if (range_count == 0)
+		errx(EX_IOERR, "No readable memory in the memory layout");
+	if (total > INT_MAX)
+		errx(EX_IOERR, "Readable memory too large to upload");
+
+	for (i = 0; i < range_count; i++) {
+		printf("Uploading 0x%08x - 0x%08x to file offset %i\n",
+		       ranges[i].start, ranges[i].start + ranges[i].size - 1,
+		       total_bytes);
+		total_bytes += ranges[i].size;
+	}
+
+	dfu_progress_bar("Upload", 0, 1);
+	total_bytes = 0;
+	for (i = 0; i < range_count; i++) {
+		int rc;
+
+		dfuse_special_command(dif, ranges[i].start, SET_ADDRESS);
+		dfu_abort_to_idle(dif);
+		rc = dfuse_upload_range(dif, xfer_size, buf, sink,
+					ranges[i].start, ranges[i].size,
+					total_bytes, total);
+		if (rc < 0) {
+			total_bytes = rc;
+			break;
+		}
+		total_bytes += rc;
+		if (rc < (int)ranges[i].size) {
+			warnx("Upload of 0x%08x ended after %i bytes",
+			      ranges[i].start, rc);
+			break;
+		}
+		dfu_abort_to_idle(dif);
+	}
+	free(ranges);
+	return total_bytes;
+}
+
 int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 		    const char *dfuse_options)
 {
-	int total_bytes = 0;
 	int upload_limit = 0;
 	unsigned char *buf;
-	int transaction;
+	struct dfu_sink *sink;
 	int ret;
 
 	buf = dfu_malloc(xfer_size);
+	sink = dfu_sink_open(fd);
 
 	if (dfuse_options)
 		dfuse_parse_options(dfuse_options);
 	if (dfuse_length)
 		upload_limit = dfuse_length;
+	if (dfuse_all && (dfuse_address || dfuse_length))
+		errx(EX_USAGE, "Uploading all memory needs no address or "
+		     "length");
+	if (dfuse_address || dfuse_all) {
+		/* on GD32 only the quirk knows the real layout */
+		mem_layout = dfuse_alt_layout(dif, dif->altsetting);
+	}
+	if (dfuse_all) {
+		ret = dfuse_upload_all(dif, xfer_size, buf, sink);
+		if (ret < 0)
+			goto out_free;
+		dfu_progress_bar("Upload", ret, ret);
+		dfu_abort_to_idle(dif);
+		goto out_leave;
+	}
 	if (dfuse_address) {
 		struct memsegment *segment;
 
-		mem_layout = parse_memory_layout((char *)dif->alt_name);
-		if (!mem_layout)
-			errx(EX_IOERR, "Failed to parse memory layout");
-
 		segment = find_segment(mem_layout, dfuse_address);
 		if (!dfuse_force &&
 		    (!segment || !(segment->memtype & DFUSE_READABLE)))
@@ -330,111 +676,552 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 		if (!upload_limit)
 			upload_limit = 0x4000;
 		printf("Limiting default upload to %i bytes\n", upload_limit);
+		/* and without an address it can not be read in windows */
+		if ((upload_limit + xfer_size - 1) / xfer_size > 0x4000)
+			errx(EX_USAGE, "Uploads without an address are limited "
+			     "to %i bytes", 0x4000 * xfer_size);
 	}
 
 	dfu_progress_bar("Upload", 0, 1);
 
-	transaction = 2;
+	ret = dfuse_upload_range(dif, xfer_size, buf, sink, dfuse_address,
+				 upload_limit, 0, upload_limit);
+	if (ret < 0)
+		goto out_free;
+
+	dfu_progress_bar("Upload", ret, ret);
+
+	dfu_abort_to_idle(dif);
+ out_leave:
+	if (dfuse_leave) {
+		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+		dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
+	}
+
+ out_free:
+	dfu_sink_close(sink);
+	free(buf);
+	dfuse_free_layouts();
+	mem_layout = NULL;
+
+	return ret;
+}
+
+/* Polls every millisecond until the request just sent is done. Returns
+ * the time the device was busy in ms, and the poll timeout it asked for
+ * at first in asked */
+static unsigned int dfuse_benchmark_busy(struct dfu_if *dif,
+					 unsigned int *asked)
+{
+	unsigned long long start = dfu_time_ms();
+	struct dfu_status dst;
+	int polls = 0;
+
+	do {
+		if (polls)
+			milli_sleep(1);
+		if (dfu_get_status(dif, &dst) < 0)
+			errx(EX_IOERR, "Error during benchmark get_status");
+		if (polls++ == 0)
+			*asked = dst.bwPollTimeout;
+	} while (dst.bState == DFU_STATE_dfuDNBUSY);
+
+	if (dst.bStatus != DFU_STATUS_OK)
+		errx(EX_IOERR, "Benchmark request failed: %s",
+		     dfu_status_to_string(dst.bStatus));
+	return dfu_time_ms() - start;
+}
+
+/*
+ * Erases and programs the page at address, timing both, and erases it
+ * again afterwards. Devices step block numbers by their own transfer
+ * size, so every chunk gets its own SET_ADDRESS, and the last one is
+ * cut at the end of the page to leave the next page alone.
+ */
+static void dfuse_benchmark_flash(struct dfu_if *dif, int xfer_size,
+				  unsigned int address,
+				  struct dfu_benchmark *bench)
+{
+	unsigned char command[5];
+	unsigned char *buf;
+	unsigned int offset;
+	unsigned int asked;
+	int chunk;
+	int i;
+
+	buf = dfu_malloc(xfer_size);
+
+	command[0] = 0x41;	/* Erase command */
+	command[1] = address & 0xff;
+	command[2] = (address >> 8) & 0xff;
+	command[3] = (address >> 16) & 0xff;
+	command[4] = (address >> 24) & 0xff;
+	if (dfuse_download(dif, sizeof(command), command, 0) < 0)
+		errx(EX_IOERR, "Error during benchmark erase");
+	bench->erase_ms = dfuse_benchmark_busy(dif, &bench->erase_poll_ms);
+
+	for (offset = 0; offset < bench->page_size; offset += chunk) {
+		chunk = bench->page_size - offset;
+		if (chunk > xfer_size)
+			chunk = xfer_size;
+		for (i = 0; i < chunk; i++)
+			buf[i] = offset + i;
+		dfuse_special_command(dif, address + offset, SET_ADDRESS);
+		if (dfuse_download(dif, chunk, buf, 2) < 0)
+			errx(EX_IOERR, "Error during benchmark download");
+		bench->program_ms += dfuse_benchmark_busy(dif, &asked);
+		bench->program_poll_ms += asked;
+		bench->program_chunks++;
+	}
+	free(buf);
+
+	dfuse_special_command(dif, address, ERASE_PAGE);
+	dfu_abort_to_idle(dif);
+}
+
+/*
+ * Measures the link like dfuload_benchmark_link(), reading from the
+ * memory segment of the given address. With force, the page at that
+ * address is erased and programmed to measure the flash timing, and
+ * is left erased.
+ */
+int dfuse_do_benchmark(struct dfu_if *dif, int xfer_size,
+		       const char *dfuse_options)
+{
+	struct dfu_benchmark bench;
+	struct memsegment *segment = NULL;
+	unsigned int page;
+
+	memset(&bench, 0, sizeof(bench));
+	if (dfuse_options)
+		dfuse_parse_options(dfuse_options);
+	if (dfuse_length || dfuse_leave || dfuse_unprotect ||
+	    dfuse_mass_erase || dfuse_diff || dfuse_all)
+		errx(EX_USAGE, "Only an address and force apply to the "
+		     "benchmark");
+	if (dfuse_force && !dfuse_address)
+		errx(EX_USAGE, "Measuring flash timing needs the address "
+		     "of a scratch page");
+
+	if (dfuse_address) {
+		mem_layout = dfuse_alt_layout(dif, dif->altsetting);
+		segment = find_segment(mem_layout, dfuse_address);
+		if (!segment)
+			errx(EX_IOERR, "No memory at 0x%08x", dfuse_address);
+	}
+	/* a scratch page is often the last one, so read from the start
+	 * of its segment to have enough to time */
+	if (dfuse_point_readable(dif, dfuse_address) < 0)
+		warnx("No readable memory, timing uploads at the current "
+		      "address");
+	dfuload_benchmark_link(dif, xfer_size, 1, &bench);
+
+	if (dfuse_force) {
+		if ((segment->memtype & (DFUSE_ERASABLE | DFUSE_WRITEABLE)) !=
+		    (DFUSE_ERASABLE | DFUSE_WRITEABLE))
+			errx(EX_IOERR, "Page at 0x%08x is not writeable flash",
+			     dfuse_address);
+		page = segment_page_start(segment, dfuse_address);
+		bench.page_size = segment->pagesize;
+		printf("Timing erase and program of the page at 0x%08x, "
+		       "%u bytes\n", page, bench.page_size);
+		dfuse_benchmark_flash(dif, xfer_size, page, &bench);
+	} else {
+		printf("Give a scratch page with -s <address>:force to "
+		       "measure flash timing\n");
+	}
+	dfuload_benchmark_summary(&bench);
+
+	dfuse_free_layouts();
+	mem_layout = NULL;
+	return 0;
+}
+
+/* Returns the DfuSe block number (wValue) addressing a chunk at the given
+ * address relative to the current address pointer, or -1 if a new
+ * SET_ADDRESS command is needed */
+static int dfuse_block_number(unsigned int address, int xfer_size)
+{
+	unsigned int offset;
+
+	if (!dfuse_block_addressing || !dfuse_pointer_valid ||
+	    address < dfuse_pointer)
+		return -1;
+	offset = address - dfuse_pointer;
+	if (offset % xfer_size || offset / xfer_size > 0xffff - 2)
+		return -1;
+	return 2 + offset / xfer_size;
+}
+
+/* Download-and-run only writes to RAM, so that nothing is erased and
+ * the code can be started right away */
+static void dfuse_check_run_page(struct memsegment *segment,
+				 unsigned long long address)
+{
+	if (dfuse_run && (segment->memtype & DFUSE_ERASABLE))
+		errx(EX_IOERR, "Page at 0x%08llx is erasable, \"run\" only "
+		     "downloads to RAM", address);
+}
+
+/* Adds the pages an element will be written to to the erase plan,
+ * after checking that all of them are writeable */
+static void dfuse_plan_element(struct dfuse_element *element)
+{
+	struct memsegment *segment;
+	unsigned int address = element->address;
+	unsigned int last = element->address + element->size - 1;
+	unsigned int page;
+
+	if (element->size == 0)
+		return;
+
 	while (1) {
-		int rc;
+		segment = find_segment(mem_layout, address);
+		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+			errx(EX_IOERR, "Page at 0x%08x is not writeable",
+				address);
+		}
+		dfuse_check_run_page(segment, address);
+		page = segment_page_start(segment, address);
+
+		/* Erase only for flash memory downloads, and only what a
+		 * mass erase of this alternate setting did not */
+		if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_all_erased) {
+			if (erase_plan_count == erase_plan_size) {
+				erase_plan_size = erase_plan_size ?
+				    2 * erase_plan_size : 64;
+				erase_plan = realloc(erase_plan,
+				    erase_plan_size * sizeof(*erase_plan));
+				if (!erase_plan)
+					errx(EX_SOFTWARE, "Out of memory");
+			}
+			erase_plan[erase_plan_count++] = page;
+		}
 
-		/* last chunk can be smaller than original xfer_size */
-		if (upload_limit - total_bytes < xfer_size)
-			xfer_size = upload_limit - total_bytes;
-		rc = dfuse_upload(dif, xfer_size, buf, transaction++);
-		if (rc < 0) {
-			ret = rc;
-			goto out_free;
+		if (last - page < (unsigned int)segment->pagesize)
+			break;
+		address = page + segment->pagesize;
+	}
+}
+
+static int dfuse_compare_pages(const void *a, const void *b)
+{
+	unsigned int page_a = *(const unsigned int *)a;
+	unsigned int page_b = *(const unsigned int *)b;
+
+	return (page_a > page_b) - (page_a < page_b);
+}
+
+/* Sorts the erase plan and removes duplicates, as elements can be out of
+ * order and share pages */
+static void dfuse_sort_plan(void)
+{
+	int count = 0;
+	int i;
+
+	qsort(erase_plan, erase_plan_count, sizeof(*erase_plan),
+	      dfuse_compare_pages);
+	for (i = 0; i < erase_plan_count; i++)
+		if (i == 0 || erase_plan[i] != erase_plan[count - 1])
+			erase_plan[count++] = erase_plan[i];
+	erase_plan_count = count;
+}
+
+/* Number of erasable pages in the memory layout */
+static int dfuse_erasable_pages(void)
+{
+	struct memsegment *segment;
+	int pages = 0;
+	int i;
+
+	for (i = 0; i < mem_layout->count; i++) {
+		segment = &mem_layout->segments[i];
+		if (segment->memtype & DFUSE_ERASABLE)
+			pages += (segment->end - segment->start + 1) /
+			    segment->pagesize;
+	}
+	return pages;
+}
+
+/* Reads device memory into buf, using block numbers for the uploads.
+ * Leaves the device in dfuIDLE state */
+static void dfuse_read_memory(struct dfu_if *dif, unsigned int address,
+			      unsigned char *buf, int length, int xfer_size)
+{
+	int done = 0;
+
+	while (done < length) {
+		/* stay well within the 16-bit block numbers */
+		int window = length - done;
+		int got;
+		int transaction;
+
+		if (window > 0x4000 * xfer_size)
+			window = 0x4000 * xfer_size;
+
+		dfuse_special_command(dif, address + done, SET_ADDRESS);
+		dfuse_pipe_sync();
+		dfu_abort_to_idle(dif);
+
+		transaction = 2;
+		for (got = 0; got < window; ) {
+			int chunk = window - got;
+			int rc;
+
+			if (chunk > xfer_size)
+				chunk = xfer_size;
+			rc = dfuse_upload(dif, chunk, buf + done + got,
+					  transaction++);
+			if (rc != chunk)
+				errx(EX_IOERR, "Short read at 0x%08x: %i of "
+				     "%i bytes", address + done + got, rc,
+				     chunk);
+			got += rc;
 		}
+		done += window;
+		dfu_abort_to_idle(dif);
+	}
+	/* uploads do not move the pointer as downloads expect */
+	dfuse_pointer_valid = 0;
+}
 
-		dfu_file_write_crc(fd, 0, buf, rc);
-		total_bytes += rc;
+/* Checks if the device content of a page already holds what the elements
+ * would write to it. Counts the bytes that would be written in *bytes */
+static int dfuse_page_unchanged(unsigned int page, int page_size,
+				const unsigned char *content,
+				struct dfuse_element *elements, int count,
+				unsigned int *bytes)
+{
+	unsigned long long page_end = (unsigned long long)page + page_size;
+	int i;
+
+	*bytes = 0;
+	for (i = 0; i < count; i++) {
+		unsigned long long start = elements[i].address;
+		unsigned long long end = start + elements[i].size;
+
+		if (start < page)
+			start = page;
+		if (end > page_end)
+			end = page_end;
+		if (start >= end)
+			continue;
+		if (memcmp(content + (start - page),
+			   elements[i].data + (start - elements[i].address),
+			   end - start))
+			return 0;
+		*bytes += end - start;
+	}
+	return 1;
+}
 
-		if (total_bytes < 0)
-			errx(EX_SOFTWARE, "Received too many bytes");
+/* Reads back the planned pages and moves those already holding the image
+ * content from the erase plan to the list of unchanged pages */
+static void dfuse_diff_planned(struct dfu_if *dif,
+			       struct dfuse_element *elements, int count,
+			       int xfer_size)
+{
+	unsigned int saved = 0;
+	int planned = erase_plan_count;
+	int kept = 0;
+	int i = 0;
 
-		if (rc < xfer_size || total_bytes >= upload_limit) {
-			/* last block, return successfully */
-			ret = total_bytes;
-			break;
+	if (planned == 0)
+		return;
+	unchanged_pages = dfu_malloc(planned * sizeof(*unchanged_pages));
+
+	dfu_progress_bar("Compare", 0, 1);
+	while (i < planned) {
+		struct memsegment *segment;
+		unsigned char *buf;
+		int run;
+		int j;
+
+		/* read contiguous pages of a segment in one go */
+		segment = find_segment(mem_layout, erase_plan[i]);
+		for (run = 1; i + run < planned; run++)
+			if (erase_plan[i + run] != erase_plan[i + run - 1] +
+			    segment->pagesize ||
+			    find_segment(mem_layout, erase_plan[i + run]) !=
+			    segment)
+				break;
+
+		if (!(segment->memtype & DFUSE_READABLE)) {
+			for (j = i; j < i + run; j++)
+				erase_plan[kept++] = erase_plan[j];
+			i += run;
+			continue;
+		}
+
+		buf = dfu_malloc(run * segment->pagesize);
+		dfuse_read_memory(dif, erase_plan[i], buf,
+				  run * segment->pagesize, xfer_size);
+		for (j = i; j < i + run; j++) {
+			unsigned int bytes;
+
+			if (dfuse_page_unchanged(erase_plan[j],
+			    segment->pagesize,
+			    buf + (j - i) * segment->pagesize,
+			    elements, count, &bytes)) {
+				if (verbose > 1)
+					printf("Page at 0x%08x unchanged\n",
+					       erase_plan[j]);
+				unchanged_pages[unchanged_pages_count++] =
+				    erase_plan[j];
+				saved += bytes;
+			} else {
+				erase_plan[kept++] = erase_plan[j];
+			}
 		}
-		dfu_progress_bar("Upload", total_bytes, upload_limit);
+		free(buf);
+		i += run;
+		dfu_progress_bar("Compare", i, planned);
 	}
+	erase_plan_count = kept;
+
+	printf("Differential download: %i of %i pages unchanged, "
+	       "%u bytes not written\n", unchanged_pages_count, planned,
+	       saved);
+}
 
-	dfu_progress_bar("Upload", total_bytes, total_bytes);
+/* Erases every planned page once. If the image covers all erasable
+ * pages anyway, a single mass erase replaces the page erases. */
+static void dfuse_erase_planned(struct dfu_if *dif)
+{
+	int count = erase_plan_count;
+	int i;
 
-	dfu_abort_to_idle(dif);
-	if (dfuse_leave) {
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
-		dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
+	if (count == 0)
+		return;
+
+	if (count > 1 && count == dfuse_erasable_pages()) {
+		printf("Image covers all %i erasable pages, performing mass "
+		       "erase instead\n", count);
+		dfuse_special_command(dif, 0, MASS_ERASE);
+		dfuse_all_erased = 1;
+		return;
 	}
 
- out_free:
-	free(buf);
+	if (verbose)
+		printf("Erasing %i pages\n", count);
+	for (i = 0; i < count; i++) {
+		if (!verbose)
+			dfu_progress_bar("Erase", i, count);
+		dfuse_special_command(dif, erase_plan[i], ERASE_PAGE);
+	}
+	if (!verbose)
+		dfu_progress_bar("Erase", count, count);
+}
 
-	return ret;
+/* Checks if a chunk only holds the erased flash value. The data is
+ * scanned a word at a time, leaving the early exit to every 64 bytes
+ * so that the compiler can vectorize the inner loop */
+static int dfuse_chunk_blank(const unsigned char *data, int size)
+{
+	unsigned long words[8];
+	unsigned long acc = ~0UL;
+	int i = 0;
+	int j;
+
+	for (; i + (int)sizeof(words) <= size; i += sizeof(words)) {
+		memcpy(words, data + i, sizeof(words));
+		for (j = 0; j < 8; j++)
+			acc &= words[j];
+		if (acc != ~0UL)
+			return 0;
+	}
+	for (; i < size; i++)
+		if (data[i] != 0xff)
+			return 0;
+	return 1;
+}
+
+/* Checks if all pages of a memory range were erased before writing */
+static int dfuse_range_erased(unsigned int address, int size)
+{
+	unsigned long long end = (unsigned long long)address + size;
+	unsigned long long next;
+	struct memsegment *segment;
+	unsigned int page;
+
+	while (address < end) {
+		segment = find_segment(mem_layout, address);
+		if (!segment || !(segment->memtype & DFUSE_ERASABLE))
+			return 0;
+		page = segment_page_start(segment, address);
+		if (!dfuse_all_erased && (!erase_plan_count ||
+		    !bsearch(&page, erase_plan, erase_plan_count,
+			     sizeof(*erase_plan), dfuse_compare_pages)))
+			return 0;
+		next = (unsigned long long)page + segment->pagesize;
+		if (next >= end)
+			break;
+		address = next;
+	}
+	return 1;
 }
 
-/* Writes an element of any size to the device, taking care of page erases */
+/* Writes one chunk of at most xfer_size bytes to the device, unless it
+ * is blank and lands on erased pages. Returns 1 if the chunk was skipped */
+static int dfuse_dnload_one(struct dfu_if *dif, unsigned int address,
+			    unsigned char *data, int chunk_size,
+			    int xfer_size)
+{
+	int ret;
+	int transaction;
+
+	/* erased flash already holds all-0xff chunks. Skipping them
+	 * keeps later chunks addressable by block number */
+	if (dfuse_chunk_blank(data, chunk_size) &&
+	    dfuse_range_erased(address, chunk_size)) {
+		if (verbose > 1)
+			printf(" Skipping blank chunk at %08x\n", address);
+		dfuse_blank_skipped++;
+		return 1;
+	}
+
+	/* Only point the device at contiguous runs, and address the
+	 * following chunks by block number */
+	transaction = dfuse_block_number(address, xfer_size);
+	if (transaction < 0) {
+		dfuse_special_command(dif, address, SET_ADDRESS);
+		/* transaction = 2 for no address offset */
+		transaction = 2;
+	} else {
+		dfuse_addresses_skipped++;
+	}
+
+	if (dfuse_pipe)
+		ret = dfu_pipe_dnload(dfuse_pipe, DFU_OP_WRITE, transaction,
+				      data, chunk_size);
+	else
+		ret = dfuse_dnload_chunk(dif, data, chunk_size, transaction);
+	if (ret != chunk_size) {
+		errx(EX_IOERR, "Failed to write whole chunk: "
+			"%i of %i bytes", ret, chunk_size);
+	}
+	return 0;
+}
+
+/* Writes an element of any size to the device. The memory must have
+ * been checked and erased by the planner already */
 /* returns 0 on success, otherwise -EINVAL */
 int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
 			 unsigned int dwElementSize, unsigned char *data,
 			 int xfer_size)
 {
 	int p;
-	int ret;
-	struct memsegment *segment;
-
-	/* Check at least that we can write to the last address */
-	segment =
-	    find_segment(mem_layout, dwElementAddress + dwElementSize - 1);
-	if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
-		errx(EX_IOERR, "Last page at 0x%08x is not writeable",
-			dwElementAddress + dwElementSize - 1);
-	}
 
 	dfu_progress_bar("Download", 0, 1);
 
 	for (p = 0; p < (int)dwElementSize; p += xfer_size) {
-		int page_size;
-		unsigned int erase_address;
 		unsigned int address = dwElementAddress + p;
 		int chunk_size = xfer_size;
 
-		segment = find_segment(mem_layout, address);
-		if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
-			errx(EX_IOERR, "Page at 0x%08x is not writeable",
-				address);
-		}
-		page_size = segment->pagesize;
-
 		/* check if this is the last chunk */
 		if (p + chunk_size > (int)dwElementSize)
 			chunk_size = dwElementSize - p;
 
-		/* Erase only for flash memory downloads */
-		if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
-			/* erase all involved pages */
-			for (erase_address = address;
-			     erase_address < address + chunk_size;
-			     erase_address += page_size)
-				if ((erase_address & ~(page_size - 1)) !=
-				    last_erased_page)
-					dfuse_special_command(dif,
-							      erase_address,
-							      ERASE_PAGE);
-
-			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
-			    last_erased_page) {
-				if (verbose > 2)
-					printf(" Chunk extends into next page,"
-					       " erase it as well\n");
-				dfuse_special_command(dif,
-						      address + chunk_size - 1,
-						      ERASE_PAGE);
-			}
-		}
-
 		if (verbose) {
 			printf(" Download from image offset "
 			       "%08x to memory %08x-%08x, size %i\n",
@@ -443,22 +1230,96 @@ int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
 		} else {
 			dfu_progress_bar("Download", p, dwElementSize);
 		}
-		
-		dfuse_special_command(dif, address, SET_ADDRESS);
 
-		/* transaction = 2 for no address offset */
-		ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
-		if (ret != chunk_size) {
-			errx(EX_IOERR, "Failed to write whole chunk: "
-				"%i of %i bytes", ret, chunk_size);
-			return -EINVAL;
-		}
+		dfuse_dnload_one(dif, address, data + p, chunk_size,
+				 xfer_size);
 	}
 	if (!verbose)
 		dfu_progress_bar("Download", dwElementSize, dwElementSize);
 	return 0;
 }
 
+static int dfuse_page_is_unchanged(unsigned int page)
+{
+	return unchanged_pages_count &&
+	    bsearch(&page, unchanged_pages, unchanged_pages_count,
+		    sizeof(*unchanged_pages), dfuse_compare_pages) != NULL;
+}
+
+/* Writes the parts of an element that are not on unchanged pages */
+static int dfuse_dnload_changed(struct dfu_if *dif,
+				struct dfuse_element *element, int xfer_size)
+{
+	unsigned long long address = element->address;
+	unsigned long long end = address + element->size;
+	unsigned long long run = address;	/* start of pending run */
+	int ret = 0;
+
+	while (address < end && ret == 0) {
+		struct memsegment *segment;
+		unsigned long long next;
+		unsigned int page;
+
+		segment = find_segment(mem_layout, address);
+		page = segment_page_start(segment, address);
+		next = (unsigned long long)page + segment->pagesize;
+		if (next > end)
+			next = end;
+		if (dfuse_page_is_unchanged(page)) {
+			if (run < address)
+				ret = dfuse_dnload_element(dif, run,
+				    address - run,
+				    element->data + (run - element->address),
+				    xfer_size);
+			run = next;
+		}
+		address = next;
+	}
+	if (run < end && ret == 0)
+		ret = dfuse_dnload_element(dif, run, end - run,
+		    element->data + (run - element->address), xfer_size);
+	return ret;
+}
+
+/* Downloads a list of elements in two passes: all needed pages are
+ * erased first, then all elements are written. In differential mode,
+ * pages already holding the image content are neither erased nor written */
+static int dfuse_dnload_elements(struct dfu_if *dif,
+				 struct dfuse_element *elements, int count,
+				 int xfer_size)
+{
+	int ret = 0;
+	int i;
+
+	erase_plan_count = 0;
+	for (i = 0; i < count; i++)
+		dfuse_plan_element(&elements[i]);
+	dfuse_sort_plan();
+
+	if (dfuse_diff)
+		dfuse_diff_planned(dif, elements, count, xfer_size);
+
+	dfuse_erase_planned(dif);
+
+	for (i = 0; i < count && ret == 0; i++) {
+		if (unchanged_pages_count)
+			ret = dfuse_dnload_changed(dif, &elements[i],
+						   xfer_size);
+		else
+			ret = dfuse_dnload_element(dif, elements[i].address,
+						   elements[i].size,
+						   elements[i].data, xfer_size);
+	}
+
+	free(erase_plan);
+	erase_plan = NULL;
+	erase_plan_count = erase_plan_size = 0;
+	free(unchanged_pages);
+	unchanged_pages = NULL;
+	unchanged_pages_count = 0;
+	return ret;
+}
+
 static void
 dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem, int size)
 {
@@ -472,39 +1333,127 @@ dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem, int size)
 	(*rem) -= size;
 }
 
-/* Download raw binary file to DfuSe device */
-int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
-			struct dfu_file *file, unsigned int start_address)
+/*
+ * Download a raw binary stream to DfuSe device. The image size is only
+ * known at the end, so pages are erased when the data first reaches
+ * them rather than all up front, and the erase plan grows in address
+ * order as it goes.
+ */
+static int dfuse_do_stream_dnload(struct dfu_if *dif, int xfer_size,
+				  struct dfu_file *file,
+				  unsigned int start_address)
 {
-	unsigned int dwElementAddress;
-	unsigned int dwElementSize;
-	unsigned char *data;
-	int ret;
+	unsigned char *buf = dfu_malloc(xfer_size);
+	unsigned int address = start_address;
+	int size;
 
-	dwElementAddress = start_address;
-	dwElementSize = file->size.total -
-	    file->size.suffix - file->size.prefix;
+	printf("Downloading stream to address = 0x%08x\n", start_address);
 
-	printf("Downloading to address = 0x%08x, size = %i\n",
-	       dwElementAddress, dwElementSize);
+	erase_plan_count = 0;
+	dfu_progress_bar("Download", 0, 1);
+	while ((size = dfu_source_read(file->source, buf, xfer_size)) > 0) {
+		struct dfuse_element element;
+		int planned = erase_plan_count;
+		int count = planned;
+		int i;
+
+		if (address == start_address && size >= 5 &&
+		    !memcmp(buf, "DfuSe", 5))
+			errx(EX_IOERR, "This is a DfuSe file, not "
+			     "meant for raw download");
+
+		element.address = address;
+		element.size = size;
+		element.data = buf;
+		dfuse_plan_element(&element);
+		for (i = planned; i < erase_plan_count; i++) {
+			if (count && erase_plan[i] <= erase_plan[count - 1])
+				continue;
+			erase_plan[count++] = erase_plan[i];
+			if (verbose)
+				printf(" Erasing page at %08x\n",
+				       erase_plan[i]);
+			dfuse_special_command(dif, erase_plan[i], ERASE_PAGE);
+		}
+		erase_plan_count = count;
 
-	data = file->firmware + file->size.prefix;
+		if (verbose)
+			printf(" Download to memory %08x-%08x, size %i\n",
+			       address, address + size - 1, size);
+		else
+			dfu_progress_bar("Download", address - start_address,
+					 0);
+		dfuse_dnload_one(dif, address, buf, size, xfer_size);
+		address += size;
+	}
+	if (!verbose)
+		dfu_progress_bar("Download", address - start_address,
+				 address - start_address);
 
-	ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
-				   xfer_size);
-	if (ret != 0)
-		goto out_free;
+	if (dfuse_pipe)
+		dfuse_pipe_sync();
+	/* completes the stream before the device is told to leave */
+	dfu_source_finish(file);
+
+	free(erase_plan);
+	erase_plan = NULL;
+	erase_plan_count = erase_plan_size = 0;
+	free(buf);
 
 	printf("File downloaded successfully\n");
-	ret = dwElementSize;
+	return address - start_address;
+}
 
- out_free:
-	return ret;
+/* Elements of an image file with addresses (see dfu_image.c) */
+static int dfuse_image_elements(struct dfu_file *file,
+				struct dfuse_element **elements)
+{
+	int i;
+
+	*elements = dfu_malloc(file->segment_count * sizeof(**elements));
+	for (i = 0; i < file->segment_count; i++) {
+		(*elements)[i].address = file->segments[i].address;
+		(*elements)[i].size = file->segments[i].size;
+		(*elements)[i].data = file->segments[i].data;
+	}
+	/* as for DfuSe files, leave to the first address unless given */
+	if (dfuse_address && !dfuse_leave)
+		errx(EX_USAGE, "Image files carry their own addresses, give "
+		     "only modifiers as in -s :leave");
+	if (dfuse_address)
+		warnx("Image written at its own addresses, 0x%08x is only "
+		      "used to leave DFU mode", dfuse_address);
+	else
+		dfuse_address = file->segments[0].address;
+	return file->segment_count;
+}
+
+/* Element of a raw binary file, to be written at start_address */
+static int dfuse_bin_elements(struct dfu_file *file,
+			      unsigned int start_address,
+			      struct dfuse_element **elements)
+{
+	if (file->bcdDFU == 0x11a) {
+		errx(EX_IOERR, "This is a DfuSe file, not "
+			"meant for raw download");
+	}
+	*elements = dfu_malloc(sizeof(**elements));
+	(*elements)->address = start_address;
+	(*elements)->size = file->size.total -
+	    file->size.suffix - file->size.prefix;
+	(*elements)->data = file->firmware + file->size.prefix;
+
+	printf("Downloading to address = 0x%08x, size = %i\n",
+	       (*elements)->address, (*elements)->size);
+	return 1;
 }
 
-/* Parse a DfuSe file and download contents to device */
-int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
-			  struct dfu_file *file)
+/*
+ * Parses a DfuSe file into the target index, checking every header and
+ * element size against the file bounds. Nothing is downloaded here, so a
+ * corrupt file fails before the device is touched.
+ */
+static void dfuse_parse_file(struct dfu_file *file)
 {
 	uint8_t dfuprefix[11];
 	uint8_t targetprefix[274];
@@ -512,14 +1461,11 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 	int image;
 	int element;
 	int bTargets;
-	int bAlternateSetting;
 	int dwNbElements;
 	unsigned int dwElementAddress;
 	unsigned int dwElementSize;
-	uint8_t *data;
-	int ret;
+	unsigned char *data;
 	int rem;
-	int bFirstAddressSaved = 0;
 
 	rem = file->size.total - file->size.prefix - file->size.suffix;
 	data = file->firmware + file->size.prefix;
@@ -534,35 +1480,56 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 
 	if (strncmp((char *)dfuprefix, "DfuSe", 5)) {
 		errx(EX_IOERR, "No valid DfuSe signature");
-		return -EINVAL;
 	}
 	if (dfuprefix[5] != 0x01) {
 		errx(EX_IOERR, "DFU format revision %i not supported",
 			dfuprefix[5]);
-		return -EINVAL;
 	}
+	if (quad2uint(dfuprefix + 6) != (unsigned int)rem + sizeof(dfuprefix))
+		warnx("DfuSe image size %u does not match file size %u",
+		      quad2uint(dfuprefix + 6),
+		      (unsigned int)rem + (unsigned int)sizeof(dfuprefix));
 	bTargets = dfuprefix[10];
 	printf("file contains %i DFU images\n", bTargets);
 
+	dfuse_free_targets();
+	if (bTargets == 0)
+		errx(EX_IOERR, "No image in DfuSe file");
+	dfuse_targets = dfu_malloc(bTargets * sizeof(*dfuse_targets));
 	for (image = 1; image <= bTargets; image++) {
+		struct dfuse_target *target = &dfuse_targets[image - 1];
+		unsigned int element_bytes = 0;
+
 		printf("parsing DFU image %i\n", image);
 		dfuse_memcpy(targetprefix, &data, &rem, sizeof(targetprefix));
 		if (strncmp((char *)targetprefix, "Target", 6)) {
 			errx(EX_IOERR, "No valid target signature");
-			return -EINVAL;
 		}
-		bAlternateSetting = targetprefix[6];
 		dwNbElements = quad2uint((unsigned char *)targetprefix + 270);
-		printf("image for alternate setting %i, ", bAlternateSetting);
+		if (dwNbElements < 0 ||
+		    dwNbElements > rem / (int)sizeof(elementheader))
+			errx(EX_IOERR, "Corrupt DfuSe file: %u elements in "
+			     "%d bytes", quad2uint(targetprefix + 270), rem);
+		target->alt = targetprefix[6];
+		target->name[0] = 0;
+		if (quad2uint(targetprefix + 7)) {
+			memcpy(target->name, targetprefix + 11, 255);
+			target->name[255] = 0;
+		}
+		target->element_count = dwNbElements;
+		target->elements = NULL;
+		if (dwNbElements)
+			target->elements = dfu_malloc(dwNbElements *
+			    sizeof(*target->elements));
+		dfuse_target_count = image;
+
+		printf("image for alternate setting %i, ", target->alt);
 		printf("(%i elements, ", dwNbElements);
 		printf("total size = %i)\n",
 		       quad2uint((unsigned char *)targetprefix + 266));
-		if (bAlternateSetting != dif->altsetting)
-			printf("Warning: Image does not match current alternate"
-			       " setting.\n"
-			       "Please rerun with the correct -a option setting"
-			       " to download this image!\n");
 		for (element = 1; element <= dwNbElements; element++) {
+			struct dfuse_element *e = &target->elements[element - 1];
+
 			printf("parsing element %i, ", element);
 			dfuse_memcpy(elementheader, &data, &rem, sizeof(elementheader));
 			dwElementAddress =
@@ -572,56 +1539,211 @@ int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 			printf("address = 0x%08x, ", dwElementAddress);
 			printf("size = %i\n", dwElementSize);
 
-			if (!bFirstAddressSaved) {
-				bFirstAddressSaved = 1;
-				dfuse_address = dwElementAddress;
-			}
 			/* sanity check */
-			if ((int)dwElementSize > rem)
+			if (dwElementSize > (unsigned int)rem)
 				errx(EX_SOFTWARE, "File too small for element size");
 
-			if (bAlternateSetting == dif->altsetting) {
-				ret = dfuse_dnload_element(dif, dwElementAddress,
-				    dwElementSize, data, xfer_size);
-			} else {
-				ret = 0;
-			}
+			e->address = dwElementAddress;
+			e->size = dwElementSize;
+			e->data = data;
+			element_bytes += sizeof(elementheader) + dwElementSize;
 
 			/* advance read pointer */
 			dfuse_memcpy(NULL, &data, &rem, dwElementSize);
-
-			if (ret != 0)
-				return ret;
 		}
+		if (element_bytes != quad2uint(targetprefix + 266))
+			warnx("Target size %u does not match its elements "
+			      "(%u bytes)", quad2uint(targetprefix + 266),
+			      element_bytes);
 	}
 
 	if (rem != 0)
 		warnx("%d bytes leftover", rem);
 
 	printf("done parsing DfuSe file\n");
+}
 
-	return 0;
+/*
+ * Groups the elements of a DfuSe file by alternate setting, so that
+ * all targets are downloaded in one session. The current alternate
+ * setting comes first, the others follow in file order.
+ */
+static int dfuse_file_passes(struct dfu_if *dif, struct dfu_file *file,
+			     struct dfuse_pass **passes)
+{
+	int pass_count = 0;
+	int i;
+	int j;
+
+	if (file->bcdDFU != 0x11a) {
+		warnx("Only DfuSe file version 1.1a is supported");
+		errx(EX_IOERR, "(for raw binary download, use the "
+		     "--dfuse-address option)");
+	}
+	dfuse_parse_file(file);
+
+	/* dfuse_parse_file() refuses files without targets */
+	*passes = dfu_malloc(dfuse_target_count * sizeof(**passes));
+	for (i = 0; i < dfuse_target_count; i++) {
+		struct dfuse_target *target = &dfuse_targets[i];
+		struct dfuse_pass *pass;
+
+		/* the first element of the file is the default for leave */
+		if (!dfuse_address && target->element_count)
+			dfuse_address = target->elements[0].address;
+		for (j = 0; j < pass_count; j++)
+			if ((*passes)[j].alt == target->alt)
+				break;
+		pass = &(*passes)[j];
+		if (j == pass_count) {
+			pass->alt = target->alt;
+			pass->name = target->name;
+			pass->elements = NULL;
+			pass->count = 0;
+			pass_count++;
+		}
+		if (target->element_count == 0)
+			continue;
+		pass->elements = realloc(pass->elements, (pass->count +
+		    target->element_count) * sizeof(*pass->elements));
+		if (!pass->elements)
+			errx(EX_SOFTWARE, "Out of memory");
+		for (j = 0; j < target->element_count; j++)
+			pass->elements[pass->count++] = target->elements[j];
+	}
+	if (pass_count == 0)
+		errx(EX_IOERR, "No image in DfuSe file");
+
+	for (i = 1; i < pass_count; i++) {
+		if ((*passes)[i].alt == dif->altsetting) {
+			struct dfuse_pass current = (*passes)[i];
+
+			memmove(&(*passes)[1], &(*passes)[0],
+				i * sizeof(**passes));
+			(*passes)[0] = current;
+			break;
+		}
+	}
+	if (pass_count > 1)
+		printf("Downloading images for %i alternate settings\n",
+		       pass_count);
+	return pass_count;
+}
+
+static int dfuse_compare_elements(const void *a, const void *b)
+{
+	const struct dfuse_element *ea = a;
+	const struct dfuse_element *eb = b;
+
+	return (ea->address > eb->address) - (ea->address < eb->address);
+}
+
+/*
+ * Checks all elements against the memory layout and against each other
+ * before anything is erased: every page written must be writeable, and
+ * no two elements may overlap.
+ */
+static void dfuse_check_elements(struct dfuse_element *elements, int count)
+{
+	struct dfuse_element *sorted;
+	unsigned long long end = 0;
+	int i;
+
+	if (count == 0)
+		return;
+	sorted = dfu_malloc(count * sizeof(*sorted));
+	memcpy(sorted, elements, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), dfuse_compare_elements);
+	for (i = 0; i < count; i++) {
+		struct dfuse_element *e = &sorted[i];
+		unsigned long long address = e->address;
+		unsigned long long last = address + e->size;
+
+		if (e->size == 0)
+			continue;
+		if (last > 0x100000000ULL)
+			errx(EX_IOERR, "Element at 0x%08x of size %u beyond "
+			     "32-bit address space", e->address, e->size);
+		if (address < end)
+			errx(EX_IOERR, "Elements overlap at 0x%08x",
+			     e->address);
+		end = last;
+		while (address < last) {
+			struct memsegment *segment;
+
+			segment = find_segment(mem_layout, address);
+			if (!segment || !(segment->memtype & DFUSE_WRITEABLE))
+				errx(EX_IOERR, "Page at 0x%08llx is not "
+				     "writeable", address);
+			dfuse_check_run_page(segment, address);
+			address = (unsigned long long)segment_page_start(
+			    segment, address) + segment->pagesize;
+		}
+	}
+	free(sorted);
 }
 
 int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		    const char *dfuse_options)
 {
-	int ret;
+	unsigned long long start_time;
+	struct dfuse_pass *passes = NULL;
+	int pass_count = 0;
+	int count = 0;
+	int ret = 0;
+	int i;
 
 	if (dfuse_options)
 		dfuse_parse_options(dfuse_options);
-	if ((dif->quirks & QUIRK_GD32) && dif->altsetting == 0)
-	{
-		printf("GD32 flash memory access detected\n");
-		mem_layout = parse_memory_gd32(dif->serial_name);
+	if (file->source && !dfuse_address)
+		errx(EX_USAGE, "Streaming a DfuSe download needs a raw "
+		     "download address");
+	dfuse_current_alt = dif->altsetting;
+	start_time = dfu_time_ms();
+
+	/* Everything to be written is known and checked up front, except
+	 * for streams */
+	if (file->segments || (dfuse_address && !file->source)) {
+		passes = dfu_malloc(sizeof(*passes));
+		passes->alt = dif->altsetting;
+		passes->name = "";
+		if (file->segments)
+			passes->count = dfuse_image_elements(file,
+			    &passes->elements);
+		else
+			passes->count = dfuse_bin_elements(file,
+			    dfuse_address, &passes->elements);
+		pass_count = 1;
+	} else if (!file->source) {
+		pass_count = dfuse_file_passes(dif, file, &passes);
 	}
-	else
-	{
-		mem_layout = parse_memory_layout((char *)dif->alt_name);
+	for (i = 0; i < pass_count; i++) {
+		mem_layout = dfuse_alt_layout(dif, passes[i].alt);
+		dfuse_check_elements(passes[i].elements, passes[i].count);
+		count += passes[i].count;
 	}
-	if (!mem_layout) {
-		errx(EX_IOERR, "Failed to parse memory layout");
+	if (verbose && pass_count)
+		printf("Checked %i elements in %llu ms\n", count,
+		       dfu_time_ms() - start_time);
+	mem_layout = dfuse_alt_layout(dif, dif->altsetting);
+
+	dfuse_all_erased = 0;
+	dfuse_blank_skipped = 0;
+
+	/* The device computes block addresses from its own transfer size */
+	dfuse_pointer_valid = 0;
+	dfuse_block_addressing = 0;
+	if ((dif->quirks & QUIRK_DFUSE_SET_ADDRESS) || dfuse_set_address) {
+		if (verbose)
+			printf("Device needs address for every block\n");
+	} else if (xfer_size != libusb_le16_to_cpu(dif->func_dfu.wTransferSize)) {
+		if (verbose)
+			printf("Transfer size differs from device's, "
+			       "setting address for every block\n");
+	} else {
+		dfuse_block_addressing = 1;
 	}
+
 	if (dfuse_unprotect) {
 		if (!dfuse_force) {
 			errx(EX_IOERR, "The read unprotect command "
@@ -632,6 +1754,24 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		printf("Device disconnects, erases flash and resets now\n");
 		exit(0);
 	}
+	if (dfuse_diff && file->source) {
+		warnx("Differential download needs the whole image, "
+		      "ignoring diff for streaming");
+		dfuse_diff = 0;
+	}
+	if (dfuse_run && dfuse_mass_erase)
+		errx(EX_USAGE, "The run modifier can not be combined with "
+		     "mass erase");
+	if (dfuse_diff && dfuse_run) {
+		warnx("Differential download is pointless for RAM, "
+		      "ignoring diff");
+		dfuse_diff = 0;
+	}
+	if (dfuse_diff && dfuse_mass_erase) {
+		warnx("Differential download is pointless after mass erase, "
+		      "ignoring diff");
+		dfuse_diff = 0;
+	}
 	if (dfuse_mass_erase) {
 		if (!dfuse_force) {
 			errx(EX_IOERR, "The mass erase command "
@@ -639,26 +1779,65 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		}
 		printf("Performing mass erase, this can take a moment\n");
 		dfuse_special_command(dif, 0, MASS_ERASE);
+		dfuse_all_erased = 1;
 	}
-	if (dfuse_address) {
-		if (file->bcdDFU == 0x11a) {
-			errx(EX_IOERR, "This is a DfuSe file, not "
-				"meant for raw download");
-		}
-		ret = dfuse_do_bin_dnload(dif, xfer_size, file, dfuse_address);
-	} else {
-		if (file->bcdDFU != 0x11a) {
-			warnx("Only DfuSe file version 1.1a is supported");
-			errx(EX_IOERR, "(for raw binary download, use the "
-			     "--dfuse-address option)");
+	dfuse_pipe = dfu_pipe_open(dif, xfer_size);
+	if (file->source) {
+		ret = dfuse_do_stream_dnload(dif, xfer_size, file,
+					     dfuse_address);
+	}
+	for (i = 0; i < pass_count && ret == 0; i++) {
+		struct dfuse_pass *pass = &passes[i];
+		unsigned long long pass_start;
+		unsigned int bytes = 0;
+		int j;
+
+		dfuse_select_alt(dif, pass->alt);
+		pass_start = dfu_time_ms();
+		ret = dfuse_dnload_elements(dif, pass->elements, pass->count,
+					    xfer_size);
+		if (pass_count > 1 && ret == 0) {
+			dfuse_pipe_sync();
+			for (j = 0; j < pass->count; j++)
+				bytes += pass->elements[j].size;
+			printf("Alternate setting %i%s%s%s: %u bytes in "
+			       "%llu ms\n", pass->alt,
+			       pass->name[0] ? " (" : "", pass->name,
+			       pass->name[0] ? ")" : "", bytes,
+			       dfu_time_ms() - pass_start);
 		}
-		ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
 	}
-	free_segment_list(mem_layout);
+	if (pass_count && ret == 0)
+		printf("File downloaded successfully\n");
+	/* leave and the caller expect the original alternate setting */
+	dfuse_select_alt(dif, dif->altsetting);
+	for (i = 0; i < pass_count; i++)
+		free(passes[i].elements);
+	free(passes);
+	dfuse_free_targets();
+	if (dfuse_pipe) {
+		dfuse_pipe_sync();
+		dfu_pipe_close(dfuse_pipe);
+		dfuse_pipe = NULL;
+	}
+	dfuse_free_layouts();
+	mem_layout = NULL;
+	if (dfuse_blank_skipped)
+		printf("Skipped %i blank chunks on erased pages\n",
+		       dfuse_blank_skipped);
+	if (verbose) {
+		printf("Download took %llu ms\n", dfu_time_ms() - start_time);
+		if (dfuse_block_addressing)
+			printf("Skipped %i address commands using block "
+			       "numbers\n", dfuse_addresses_skipped);
+	}
+	dfu_poll_report();
 
 	dfu_abort_to_idle(dif);
 
 	if (dfuse_leave) {
+		if (dfuse_run)
+			printf("Starting code at 0x%08x\n", dfuse_address);
 		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
 		dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
 	}
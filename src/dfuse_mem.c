@@ -28,101 +28,256 @@
 #include "dfu_file.h"
 #include "dfuse_mem.h"
 
-int add_segment(struct memsegment **segment_list, struct memsegment segment)
+/* Inserts a segment in address order. Segments mostly come in ascending
+ * order, so this is usually an append */
+int add_segment(struct memlayout **layout, struct memsegment segment)
 {
-	struct memsegment *new_element;
-
-	new_element = dfu_malloc(sizeof(struct memsegment));
-	*new_element = segment;
-	new_element->next = NULL;
-
-	if (*segment_list == NULL)
-		/* list can be empty on first call */
-		*segment_list = new_element;
-	else {
-		struct memsegment *next_element;
-
-		/* find last element in list */
-		next_element = *segment_list;
-		while (next_element->next != NULL)
-			next_element = next_element->next;
-		next_element->next = new_element;
+	struct memlayout *l = *layout;
+	int pos;
+
+	if (l == NULL) {
+		/* layout can be empty on first call */
+		l = dfu_malloc(sizeof(*l));
+		l->segments = NULL;
+		l->count = l->size = l->last = 0;
+		*layout = l;
 	}
+	if (l->count == l->size) {
+		l->size = l->size ? 2 * l->size : 8;
+		l->segments = realloc(l->segments,
+		    l->size * sizeof(*l->segments));
+		if (!l->segments)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+
+	segment.pageshift = -1;
+	if (segment.pagesize > 0 &&
+	    (segment.pagesize & (segment.pagesize - 1)) == 0) {
+		segment.pageshift = 0;
+		while ((1 << segment.pageshift) != segment.pagesize)
+			segment.pageshift++;
+	}
+
+	pos = l->count;
+	while (pos > 0 && l->segments[pos - 1].start > segment.start)
+		pos--;
+	if ((pos > 0 && l->segments[pos - 1].end >= segment.start) ||
+	    (pos < l->count && segment.end >= l->segments[pos].start))
+		warnx("Memory segment at 0x%08x overlaps another one",
+		      segment.start);
+	memmove(&l->segments[pos + 1], &l->segments[pos],
+		(l->count - pos) * sizeof(*l->segments));
+	l->segments[pos] = segment;
+	l->count++;
 	return 0;
 }
 
-struct memsegment *find_segment(struct memsegment *segment_list,
+/* Finds the segment holding an address. Sequential accesses stay in the
+ * segment found last or move on to the next one, anything else is a
+ * binary search */
+struct memsegment *find_segment(struct memlayout *layout,
 				unsigned int address)
 {
-	while (segment_list != NULL) {
-		if (segment_list->start <= address &&
-		    segment_list->end >= address)
-			return segment_list;
-		segment_list = segment_list->next;
+	struct memsegment *segment;
+	int low, high;
+
+	if (layout == NULL || layout->count == 0)
+		return NULL;
+
+	segment = &layout->segments[layout->last];
+	if (segment->start <= address && segment->end >= address)
+		return segment;
+	if (layout->last + 1 < layout->count) {
+		segment++;
+		if (segment->start <= address && segment->end >= address) {
+			layout->last++;
+			return segment;
+		}
+	}
+
+	low = 0;
+	high = layout->count - 1;
+	while (low <= high) {
+		int mid = low + (high - low) / 2;
+
+		segment = &layout->segments[mid];
+		if (address < segment->start)
+			high = mid - 1;
+		else if (address > segment->end)
+			low = mid + 1;
+		else {
+			layout->last = mid;
+			return segment;
+		}
 	}
 	return NULL;
 }
 
-void free_segment_list(struct memsegment *segment_list)
+/* Start address of the page containing an address in a segment */
+unsigned int segment_page_start(const struct memsegment *segment,
+				unsigned int address)
 {
-	struct memsegment *next_element;
+	unsigned int offset = address - segment->start;
 
-	while (segment_list->next != NULL) {
-		next_element = segment_list->next;
-		free(segment_list);
-		segment_list = next_element;
-	}
-	free(segment_list);
+	if (segment->pageshift >= 0)
+		return address - (offset & (segment->pagesize - 1));
+	return address - offset % segment->pagesize;
 }
 
-struct memsegment *parse_memory_gd32(char *model_desc_str)
+void free_memory_layout(struct memlayout *layout)
 {
-	char name[32];
-	struct memsegment *segment_list = NULL;
-	struct memsegment segment;
+	if (layout == NULL)
+		return;
+	free(layout->segments);
+	free(layout);
+}
 
-	int pages = 0;
+/*
+ * GD32 models, by the characters of the serial string the bootloader
+ * reports instead of a DfuSe memory descriptor: '3', the package code,
+ * the flash size code and the family code, as in "3CBJ" for the
+ * GD32VF103CB. Sizes are in bytes.
+ */
+struct gd32_model {
+	char family;
+	char flash;
+	char name[24];
+	unsigned int flash_start;
+	unsigned int flash_size;
+	int page_size;
+	unsigned int sram_start;
+	unsigned int sram_size;
+	unsigned int option_start;
+	unsigned int option_size;
+};
+
+static const struct gd32_model gd32_models[] = {
+	{ 'J', '4', "GD32VF103", 0x08000000,  16 * 1024, 1024,
+	  0x20000000,  6 * 1024, 0x1ffff800, 16 },
+	{ 'J', '6', "GD32VF103", 0x08000000,  32 * 1024, 1024,
+	  0x20000000, 10 * 1024, 0x1ffff800, 16 },
+	{ 'J', '8', "GD32VF103", 0x08000000,  64 * 1024, 1024,
+	  0x20000000, 20 * 1024, 0x1ffff800, 16 },
+	{ 'J', 'B', "GD32VF103", 0x08000000, 128 * 1024, 1024,
+	  0x20000000, 32 * 1024, 0x1ffff800, 16 },
+};
+
+/* Models read by gd32_load_models(), searched before the table */
+static struct gd32_model *gd32_extra_models;
+static int gd32_extra_count = 0;
 
-	if(model_desc_str[0] != '3')
-	{
-		errx(EX_IOERR, "It seems not like a GD32 device");
-		return NULL;
+/*
+ * Reads additional or corrected GD32 models from a text file, one per
+ * line with the fields of struct gd32_model:
+ *
+ *   J B GD32VF103 0x08000000 131072 1024 0x20000000 32768 0x1ffff800 16
+ *
+ * Empty lines and lines starting with '#' are ignored.
+ */
+void gd32_load_models(const char *path)
+{
+	struct gd32_model model;
+	char line[256];
+	FILE *f;
+	int lineno = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		err(EX_IOERR, "Could not open GD32 model file %s", path);
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+
+		lineno++;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+			continue;
+		memset(&model, 0, sizeof(model));
+		if (sscanf(p, " %c %c %23s %x %u %d %x %u %x %u",
+			   &model.family, &model.flash, model.name,
+			   &model.flash_start, &model.flash_size,
+			   &model.page_size, &model.sram_start,
+			   &model.sram_size, &model.option_start,
+			   &model.option_size) != 10)
+			errx(EX_USAGE, "%s:%i: Expected family, flash code, "
+			     "name and seven addresses and sizes", path, lineno);
+		if (model.page_size <= 0 ||
+		    model.flash_size % model.page_size)
+			errx(EX_USAGE, "%s:%i: Flash size is not a multiple "
+			     "of the page size", path, lineno);
+		gd32_extra_models = realloc(gd32_extra_models,
+		    (gd32_extra_count + 1) * sizeof(*gd32_extra_models));
+		if (!gd32_extra_models)
+			errx(EX_SOFTWARE, "Out of memory");
+		gd32_extra_models[gd32_extra_count++] = model;
 	}
+	fclose(f);
+	if (verbose)
+		printf("Read %i GD32 models from %s\n", gd32_extra_count,
+		       path);
+}
 
-	switch(model_desc_str[3])
-	{
-		case 'J':
-			strcpy(name, "GD32VF103");
-			segment.start = 0x08000000;
-			segment.memtype = DFUSE_READABLE | DFUSE_ERASABLE | DFUSE_WRITEABLE;
-			segment.pagesize = 1024;
-			switch(model_desc_str[2])
-			{
-				case 'B':
-					pages = 128;
-				break;
-				case '8':
-					pages = 64;
-				break;
-				default:
-					warnx("GD32VF103: Use 64KB for default");
-					pages = 64;
-				break;
-			}
-			segment.end = segment.start +
-				pages * segment.pagesize - 1;
-		break;
-		default:
-			errx(EX_IOERR, "I don't know what model it is");
-			return NULL;
-		break;
+static const struct gd32_model *gd32_find_model(char family, char flash)
+{
+	unsigned int i;
+	int j;
+
+	/* the last definition in the file wins */
+	for (j = gd32_extra_count - 1; j >= 0; j--)
+		if (gd32_extra_models[j].family == family &&
+		    gd32_extra_models[j].flash == flash)
+			return &gd32_extra_models[j];
+	for (i = 0; i < sizeof(gd32_models) / sizeof(gd32_models[0]); i++)
+		if (gd32_models[i].family == family &&
+		    gd32_models[i].flash == flash)
+			return &gd32_models[i];
+	return NULL;
+}
+
+/*
+ * Stands in for a model of a known family with an unknown flash size
+ * code, as 64 KiB of flash like before the table existed. The family's
+ * 64 KiB model is used if there is one, otherwise any of its models.
+ */
+static const struct gd32_model *gd32_fallback_model(char family)
+{
+	static struct gd32_model fallback;
+	const struct gd32_model *model = NULL;
+	unsigned int i;
+	int any;
+	int j;
+
+	for (any = 0; any <= 1 && !model; any++) {
+		for (j = gd32_extra_count - 1; j >= 0 && !model; j--)
+			if (gd32_extra_models[j].family == family &&
+			    (any || gd32_extra_models[j].flash_size ==
+			     64 * 1024))
+				model = &gd32_extra_models[j];
+		for (i = 0; i < sizeof(gd32_models) / sizeof(gd32_models[0]) &&
+		     !model; i++)
+			if (gd32_models[i].family == family &&
+			    (any || gd32_models[i].flash_size == 64 * 1024))
+				model = &gd32_models[i];
 	}
+	if (!model)
+		return NULL;
 
-	strncat(name, &model_desc_str[1], 2);
+	fallback = *model;
+	fallback.flash_size = 64 * 1024;
+	return &fallback;
+}
 
-	printf("Device model: %s\n", name);
+static void gd32_add_segment(struct memlayout **segment_list,
+			     unsigned int start, unsigned int size,
+			     int pagesize, int memtype)
+{
+	struct memsegment segment;
 
-	add_segment(&segment_list, segment);
+	segment.start = start;
+	segment.end = start + size - 1;
+	segment.pagesize = pagesize;
+	segment.memtype = memtype;
+	add_segment(segment_list, segment);
 
 	printf("Memory segment (0x%08x - %08x)"
 		"(%s%s%s)\n",
@@ -130,9 +285,54 @@ struct memsegment *parse_memory_gd32(char *model_desc_str)
 		segment.memtype & DFUSE_READABLE  ? "r" : "",
 		segment.memtype & DFUSE_ERASABLE  ? "e" : "",
 		segment.memtype & DFUSE_WRITEABLE ? "w" : "");
+}
+
+struct memlayout *parse_memory_gd32(char *model_desc_str)
+{
+	const struct gd32_model *model;
+	struct memlayout *segment_list = NULL;
+	char name[32];
+
+	if (!model_desc_str || strlen(model_desc_str) < 4 ||
+	    model_desc_str[0] != '3')
+	{
+		errx(EX_IOERR, "It seems not like a GD32 device");
+		return NULL;
+	}
+
+	model = gd32_find_model(model_desc_str[3], model_desc_str[2]);
+	if (!model) {
+		model = gd32_fallback_model(model_desc_str[3]);
+		if (model)
+			warnx("%s: Unknown flash size code '%c', use 64KB for "
+			      "default (see --gd32-models)", model->name,
+			      model_desc_str[2]);
+	}
+	if (!model) {
+		errx(EX_IOERR, "Unknown GD32 family code \"%.4s\", describe it "
+		     "in a model file (see --gd32-models)", model_desc_str);
+		return NULL;
+	}
+
+	snprintf(name, sizeof(name), "%s%.2s", model->name,
+		 &model_desc_str[1]);
+	printf("Device model: %s\n", name);
+
+	gd32_add_segment(&segment_list, model->flash_start,
+			 model->flash_size, model->page_size,
+			 DFUSE_READABLE | DFUSE_ERASABLE | DFUSE_WRITEABLE);
 	printf("Erase size %d, page count %d\n",
-		segment.pagesize,
-		pages);
+		model->page_size,
+		model->flash_size / model->page_size);
+	/* RAM can be written without erasing, for download-and-run */
+	if (model->sram_size)
+		gd32_add_segment(&segment_list, model->sram_start,
+				 model->sram_size, model->page_size,
+				 DFUSE_READABLE | DFUSE_WRITEABLE);
+	if (model->option_size)
+		gd32_add_segment(&segment_list, model->option_start,
+				 model->option_size, model->option_size,
+				 DFUSE_READABLE);
 
 	return segment_list;
 }
@@ -140,7 +340,7 @@ struct memsegment *parse_memory_gd32(char *model_desc_str)
 /* Parse memory map from interface descriptor string
  * encoded as per ST document UM0424 section 4.3.2.
  */
-struct memsegment *parse_memory_layout(char *intf_desc)
+struct memlayout *parse_memory_layout(char *intf_desc)
 {
 
 	char multiplier, memtype;
@@ -151,7 +351,7 @@ struct memsegment *parse_memory_layout(char *intf_desc)
 	int count = 0;
 	char separator;
 	int scanned;
-	struct memsegment *segment_list = NULL;
+	struct memlayout *segment_list = NULL;
 	struct memsegment segment;
 
 	name = dfu_malloc(strlen(intf_desc));
@@ -29,18 +29,31 @@ struct memsegment {
 	unsigned int start;
 	unsigned int end;
 	int pagesize;
+	int pageshift;	/* log2 of pagesize if a power of two, else -1 */
 	int memtype;
-	struct memsegment *next;
 };
 
-int add_segment(struct memsegment **list, struct memsegment new_element);
+/* Segments sorted by start address, for binary search */
+struct memlayout {
+	struct memsegment *segments;
+	int count;
+	int size;
+	int last;	/* index of the segment found last */
+};
+
+int add_segment(struct memlayout **layout, struct memsegment new_element);
+
+struct memsegment *find_segment(struct memlayout *layout, unsigned int address);
+
+unsigned int segment_page_start(const struct memsegment *segment,
+				unsigned int address);
 
-struct memsegment *find_segment(struct memsegment *list, unsigned int address);
+void free_memory_layout(struct memlayout *layout);
 
-void free_segment_list(struct memsegment *list);
+struct memlayout *parse_memory_layout(char *intf_desc_str);
 
-struct memsegment *parse_memory_layout(char *intf_desc_str);
+struct memlayout *parse_memory_gd32(char *model_desc_str);
 
-struct memsegment *parse_memory_gd32(char *model_desc_str);
+void gd32_load_models(const char *path);
 
 #endif /* DFUSE_MEM_H */
@@ -0,0 +1,247 @@
+/*
+ * Gang programming of several devices from one dfu-util invocation
+ *
+ * The transfer code keeps its session state in file scope variables and
+ * gives up with errx() on errors, so every device is handled by a forked
+ * worker running the usual single device sequence, restricted to the
+ * port path of its device. The port path does not change when a device
+ * re-enumerates in DFU mode after detach, so it identifies the device for
+ * the whole sequence. The parent collects the worker output, prefixed by
+ * the path, and reports the result and time taken per device.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfu_util.h"
+#include "gang.h"
+
+#ifdef HAVE_FORK
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+/* Collects the distinct port paths of the matched devices */
+int gang_paths(char ***paths)
+{
+	struct dfu_if *pdfu;
+	int count = 0;
+	int i;
+
+	*paths = NULL;
+	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
+		const char *path = get_path(pdfu->dev);
+
+		if (!*path) {
+			warnx("Cannot determine port path of device %04x:%04x, "
+			      "skipping it", pdfu->vendor, pdfu->product);
+			continue;
+		}
+		for (i = 0; i < count; i++)
+			if (!strcmp((*paths)[i], path))
+				break;
+		if (i < count)
+			continue;
+		*paths = realloc(*paths, (count + 1) * sizeof(**paths));
+		if (!*paths)
+			errx(EX_SOFTWARE, "Out of memory");
+		(*paths)[count] = strdup(path);
+		if (!(*paths)[count])
+			errx(EX_SOFTWARE, "Out of memory");
+		count++;
+	}
+	return count;
+}
+
+#ifdef HAVE_FORK
+
+struct gang_worker {
+	char *path;
+	pid_t pid;
+	int fd;			/* output of the worker, -1 after EOF */
+	char line[256];		/* incomplete output line */
+	int len;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+/* Prints complete lines of worker output, prefixed by its path */
+static void gang_output(struct gang_worker *w, const char *data, int length)
+{
+	int i;
+
+	for (i = 0; i < length; i++) {
+		char c = data[i];
+
+		if (c == '\r' || c == '\n' || w->len == sizeof(w->line) - 1) {
+			if (w->len)
+				printf("%s: %.*s\n", w->path, w->len, w->line);
+			w->len = 0;
+			if (c == '\r' || c == '\n')
+				continue;
+		}
+		w->line[w->len++] = c;
+	}
+}
+
+/* Forks a worker per device path. Returns the path to work on in the
+ * workers, while the parent waits for all of them and exits */
+char *gang_run(char **paths, int count)
+{
+	struct gang_worker *workers;
+	struct pollfd *fds;
+	int *fd_worker;
+	unsigned long long start = dfu_time_ms();
+	int failed = 0;
+	int i;
+
+	workers = dfu_malloc(count * sizeof(*workers));
+	memset(workers, 0, count * sizeof(*workers));
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < count; i++) {
+		int pipefd[2];
+		int j;
+
+		if (pipe(pipefd) < 0)
+			err(EX_SOFTWARE, "Cannot create pipe");
+		workers[i].path = paths[i];
+		workers[i].start = dfu_time_ms();
+		workers[i].pid = fork();
+		if (workers[i].pid < 0)
+			err(EX_SOFTWARE, "Cannot start worker for %s",
+			    paths[i]);
+		if (workers[i].pid == 0) {
+			/* errors always go to the parent, progress only
+			 * when asked for, it does not interleave well */
+			close(pipefd[0]);
+			for (j = 0; j < i; j++)
+				close(workers[j].fd);
+			dup2(pipefd[1], STDERR_FILENO);
+			if (verbose) {
+				dup2(pipefd[1], STDOUT_FILENO);
+			} else {
+				int null = open("/dev/null", O_WRONLY);
+
+				if (null >= 0) {
+					dup2(null, STDOUT_FILENO);
+					close(null);
+				}
+			}
+			close(pipefd[1]);
+			free(workers);
+			return paths[i];
+		}
+		close(pipefd[1]);
+		workers[i].fd = pipefd[0];
+	}
+	printf("Started %i workers\n", count);
+
+	fds = dfu_malloc(count * sizeof(*fds));
+	fd_worker = dfu_malloc(count * sizeof(*fd_worker));
+	while (1) {
+		int nfds = 0;
+
+		for (i = 0; i < count; i++) {
+			if (workers[i].fd < 0)
+				continue;
+			fds[nfds].fd = workers[i].fd;
+			fds[nfds].events = POLLIN;
+			fd_worker[nfds++] = i;
+		}
+		if (nfds == 0)
+			break;
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EX_SOFTWARE, "Cannot poll workers");
+		}
+		for (i = 0; i < nfds; i++) {
+			struct gang_worker *w = &workers[fd_worker[i]];
+			char buf[512];
+			ssize_t r;
+
+			if (!fds[i].revents)
+				continue;
+			r = read(w->fd, buf, sizeof(buf));
+			if (r > 0) {
+				gang_output(w, buf, r);
+				continue;
+			}
+			if (r < 0 && errno == EINTR)
+				continue;
+			/* the worker has exited, or is about to */
+			gang_output(w, "\n", 1);
+			close(w->fd);
+			w->fd = -1;
+			w->end = dfu_time_ms();
+		}
+	}
+	free(fd_worker);
+	free(fds);
+
+	printf("Gang programming results:\n");
+	for (i = 0; i < count; i++) {
+		struct gang_worker *w = &workers[i];
+		int status;
+
+		while (waitpid(w->pid, &status, 0) < 0) {
+			if (errno != EINTR)
+				err(EX_SOFTWARE, "Cannot wait for worker");
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			printf("  %-20s OK      %8llu ms\n", w->path,
+			       w->end - w->start);
+			continue;
+		}
+		failed++;
+		if (WIFEXITED(status))
+			printf("  %-20s FAILED  %8llu ms (exit status %i)\n",
+			       w->path, w->end - w->start,
+			       WEXITSTATUS(status));
+		else
+			printf("  %-20s FAILED  %8llu ms (signal %i)\n",
+			       w->path, w->end - w->start,
+			       WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+	}
+	printf("%i of %i devices done in %llu ms\n", count - failed, count,
+	       dfu_time_ms() - start);
+	free(workers);
+	exit(failed ? EX_IOERR : EX_OK);
+}
+
+#else
+
+char *gang_run(char **paths, int count)
+{
+	(void)paths;
+	(void)count;
+	errx(EX_SOFTWARE, "Gang programming is not supported on this "
+	     "platform");
+	return NULL;
+}
+
+#endif /* HAVE_FORK */
@@ -0,0 +1,7 @@
+#ifndef GANG_H
+#define GANG_H
+
+int gang_paths(char ***paths);
+char *gang_run(char **paths, int count);
+
+#endif /* GANG_H */
@@ -37,9 +37,14 @@
 #include "dfu.h"
 #include "usb_dfu.h"
 #include "dfu_file.h"
+#include "dfu_image.h"
 #include "dfu_load.h"
 #include "dfu_util.h"
+#include "dfu_async.h"
+#include "dfu_emu.h"
 #include "dfuse.h"
+#include "dfuse_mem.h"
+#include "gang.h"
 #include "quirks.h"
 
 int verbose = 0;
@@ -58,6 +63,22 @@ const char *match_iface_alt_name = NULL;
 const char *match_serial = NULL;
 const char *match_serial_dfu = NULL;
 
+/* IDs of the device in runtime mode, or as it was matched */
+static uint16_t runtime_vendor;
+static uint16_t runtime_product;
+
+/* Checks the IDs from a file suffix against the device in either mode */
+static int file_ids_match(const struct dfu_file *file)
+{
+	if ((file->idVendor  == 0xffff || file->idVendor  == runtime_vendor) &&
+	    (file->idProduct == 0xffff || file->idProduct == runtime_product))
+		return 1;
+	if ((file->idVendor  == 0xffff || file->idVendor  == dfu_root->vendor) &&
+	    (file->idProduct == 0xffff || file->idProduct == dfu_root->product))
+		return 1;
+	return 0;
+}
+
 static int parse_match_value(const char *str, int default_value)
 {
 	char *remainder;
@@ -139,6 +160,21 @@ static void parse_serial(char *str)
 	if (*match_serial_dfu == 0) match_serial_dfu = NULL;
 }
 
+#if defined(HAVE_GETPAGESIZE) && !defined(__MINGW32__)
+/* Kernels before Linux 3.3 limited the size of usbfs transfer buffers.
+ * The usbfs_memory_mb parameter came with the rework lifting that limit,
+ * so only cap the transfer size when it is missing */
+static int usbfs_size_limited(void)
+{
+#ifdef __linux__
+	return access("/sys/module/usbcore/parameters/usbfs_memory_mb",
+		      F_OK) != 0;
+#else
+	return 0;
+#endif
+}
+#endif /* HAVE_GETPAGESIZE && !__MINGW32__ */
+
 static int parse_number(char *str, char *nmb)
 {
 	char *endptr;
@@ -167,7 +203,8 @@ static void help(void)
 		"  -v --verbose\t\t\tPrint verbose debug statements\n"
 		"  -l --list\t\t\tList currently attached DFU capable devices\n");
 	fprintf(stderr, "  -e --detach\t\t\tDetach currently attached DFU capable devices\n"
-		"  -E --detach-delay seconds\tTime to wait before reopening a device after detach\n"
+		"  -E --detach-delay seconds\tMaximum time to wait for a device to reappear\n"
+		"\t\t\t\tin DFU mode after detach\n"
 		"  -d --device <vendor>:<product>[,<vendor_dfu>:<product_dfu>]\n"
 		"\t\t\t\tSpecify Vendor/Product ID(s) of DFU device\n"
 		"  -p --path <bus-port. ... .port>\tSpecify path to DFU device\n"
@@ -177,14 +214,28 @@ static void help(void)
 		"\t\t\t\tSpecify Serial String of DFU device\n"
 		"  -a --alt <alt>\t\tSpecify the Altsetting of the DFU Interface\n"
 		"\t\t\t\tby name or by number\n");
-	fprintf(stderr, "  -t --transfer-size <size>\tSpecify the number of bytes per USB Transfer\n"
+	fprintf(stderr, "  -t --transfer-size <size>\tSpecify the number of bytes per USB Transfer,\n"
+		"\t\t\t\tor \"auto\" to probe the device for the fastest size\n"
 		"  -U --upload <file>\t\tRead firmware from device into <file>\n"
 		"  -Z --upload-size <bytes>\tSpecify the expected upload size in bytes\n"
 		"  -D --download <file>\t\tWrite firmware from <file> into device\n"
+		"  -b --stream\t\t\tDownload while reading <file>, for pipes\n"
+		"  -B --benchmark\t\tMeasure USB round trip, upload throughput and,\n"
+		"\t\t\t\twith -s <address>:force, flash timing\n"
 		"  -R --reset\t\t\tIssue USB Reset signalling once we're finished\n"
+		"  -A --async\t\t\tPipeline download requests using asynchronous\n"
+		"\t\t\t\tUSB transfers\n"
+		"  -P --adaptive-poll\t\tPoll download status by learned busy times\n"
+		"\t\t\t\tinstead of the reported poll timeout\n"
+		"  -G --gang\t\t\tProgram all matching devices in parallel\n"
 		"  -s --dfuse-address <address>\tST DfuSe mode, specify target address for\n"
 		"\t\t\t\traw file download or upload. Not applicable for\n"
 		"\t\t\t\tDfuSe file (.dfu) downloads\n"
+		"  -M --gd32-models <file>\tRead additional GD32 memory layouts\n"
+		"\t\t\t\tfrom <file>\n"
+		"  -X --emulate <device>[:<setting>=<value>...]\n"
+		"\t\t\t\tTalk to an emulated device instead of USB,\n"
+		"\t\t\t\t\"-X help\" lists devices and settings\n"
 		);
 	exit(EX_USAGE);
 }
@@ -218,8 +269,15 @@ static struct option opts[] = {
 	{ "upload", 1, 0, 'U' },
 	{ "upload-size", 1, 0, 'Z' },
 	{ "download", 1, 0, 'D' },
+	{ "stream", 0, 0, 'b' },
+	{ "benchmark", 0, 0, 'B' },
 	{ "reset", 0, 0, 'R' },
+	{ "async", 0, 0, 'A' },
+	{ "adaptive-poll", 0, 0, 'P' },
+	{ "gang", 0, 0, 'G' },
 	{ "dfuse-address", 1, 0, 's' },
+	{ "gd32-models", 1, 0, 'M' },
+	{ "emulate", 1, 0, 'X' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -227,19 +285,24 @@ int main(int argc, char **argv)
 {
 	int expected_size = 0;
 	unsigned int transfer_size = 0;
+	int probe_transfer_size = 0;
 	enum mode mode = MODE_NONE;
 	struct dfu_status status;
 	libusb_context *ctx;
 	struct dfu_file file;
 	char *end;
 	int final_reset = 0;
+	int use_async = 0;
+	int gang = 0;
 	int ret;
 	int dfuse_device = 0;
 	int fd;
 	const char *dfuse_options = NULL;
+	const char *emulate = NULL;
 	int detach_delay = 5;
-	uint16_t runtime_vendor;
-	uint16_t runtime_product;
+	char *runtime_path;
+	unsigned long long start;
+	int stream = 0;
 
 	memset(&file, 0, sizeof(file));
 
@@ -248,7 +311,7 @@ int main(int argc, char **argv)
 
 	while (1) {
 		int c, option_index = 0;
-		c = getopt_long(argc, argv, "hVvleE:d:p:c:i:a:S:t:U:D:Rs:Z:", opts,
+		c = getopt_long(argc, argv, "hVvleE:d:p:c:i:a:S:t:U:D:bBRAPGs:Z:M:X:", opts,
 				&option_index);
 		if (c == -1)
 			break;
@@ -298,7 +361,11 @@ int main(int argc, char **argv)
 			parse_serial(optarg);
 			break;
 		case 't':
-			transfer_size = parse_number("transfer-size", optarg);
+			if (!strcmp(optarg, "auto"))
+				probe_transfer_size = 1;
+			else
+				transfer_size = parse_number("transfer-size",
+							     optarg);
 			break;
 		case 'U':
 			mode = MODE_UPLOAD;
@@ -311,12 +378,37 @@ int main(int argc, char **argv)
 			mode = MODE_DOWNLOAD;
 			file.name = optarg;
 			break;
+		case 'b':
+			stream = 1;
+			break;
+		case 'B':
+			mode = MODE_BENCHMARK;
+			break;
 		case 'R':
 			final_reset = 1;
 			break;
+		case 'A':
+			use_async = 1;
+			break;
+		case 'P':
+			dfu_adaptive_poll = 1;
+			break;
+		case 'G':
+			gang = 1;
+			break;
 		case 's':
 			dfuse_options = optarg;
 			break;
+		case 'M':
+			gd32_load_models(optarg);
+			break;
+		case 'X':
+			if (!strcmp(optarg, "help")) {
+				dfu_emu_help();
+				exit(0);
+			}
+			emulate = optarg;
+			break;
 		default:
 			help();
 			break;
@@ -329,7 +421,7 @@ int main(int argc, char **argv)
 	}
 
 	if (mode == MODE_NONE) {
-		fprintf(stderr, "You need to specify one of -D or -U\n");
+		fprintf(stderr, "You need to specify one of -D, -U or -B\n");
 		help();
 	}
 
@@ -338,7 +430,16 @@ int main(int argc, char **argv)
 		match_config_index = -1;
 	}
 
-	if (mode == MODE_DOWNLOAD) {
+	if (stream && mode != MODE_DOWNLOAD)
+		errx(EX_USAGE, "Streaming only applies to downloads");
+	if (stream && gang)
+		errx(EX_USAGE, "Gang mode can not be used with streaming");
+
+	if (mode == MODE_DOWNLOAD && stream) {
+		/* the suffix is only seen at the end, so its IDs are
+		 * checked then and not used for device matching */
+		dfu_source_open(&file, file_ids_match);
+	} else if (mode == MODE_DOWNLOAD) {
 		dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
 		/* If the user didn't specify product and/or vendor IDs to match,
 		 * use any IDs from the file suffix for device matching */
@@ -360,6 +461,23 @@ int main(int argc, char **argv)
 		libusb_set_debug(ctx, 255);
 	}
 
+	if (use_async)
+		dfu_async_ctx = ctx;
+
+	if (emulate) {
+		if (mode == MODE_LIST || gang)
+			errx(EX_USAGE, "Emulated devices can not be listed "
+			     "or gang programmed");
+		/* asynchronous transfers go straight to libusb */
+		dfu_async_ctx = NULL;
+		dfu_root = dfu_emu_open(emulate, match_iface_alt_index,
+					match_iface_alt_name);
+		runtime_vendor = dfu_root->vendor;
+		runtime_product = dfu_root->product;
+		printf("ID %04x:%04x\n", dfu_root->vendor, dfu_root->product);
+		goto dfustate;
+	}
+
 	probe_devices(ctx);
 
 	if (mode == MODE_LIST) {
@@ -367,6 +485,31 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	if (gang && dfu_root != NULL) {
+		char **paths;
+		int count;
+
+		if (mode == MODE_UPLOAD || mode == MODE_BENCHMARK)
+			errx(EX_USAGE, "Gang mode can not be used for upload "
+			     "or benchmark");
+		count = gang_paths(&paths);
+		if (count == 0)
+			errx(EX_IOERR, "No device with a known port path");
+		printf("Gang programming %i devices\n", count);
+
+		/* every worker starts over with its own libusb session */
+		disconnect_devices();
+		libusb_exit(ctx);
+		match_path = gang_run(paths, count);
+
+		ret = libusb_init(&ctx);
+		if (ret)
+			errx(EX_IOERR, "unable to initialize libusb: %i", ret);
+		if (use_async)
+			dfu_async_ctx = ctx;
+		probe_devices(ctx);
+	}
+
 	if (dfu_root == NULL) {
 		errx(EX_IOERR, "No DFU capable USB device available");
 	} else if (dfu_root->next != NULL) {
@@ -465,6 +608,9 @@ int main(int argc, char **argv)
 					 dfu_root->interface);
 		libusb_close(dfu_root->dev_handle);
 		dfu_root->dev_handle = NULL;
+		runtime_path = strdup(get_path(dfu_root->dev));
+		if (!runtime_path)
+			errx(EX_SOFTWARE, "Out of memory");
 
 		if (mode == MODE_DETACH) {
 			libusb_exit(ctx);
@@ -474,7 +620,23 @@ int main(int argc, char **argv)
 		/* keeping handles open might prevent re-enumeration */
 		disconnect_devices();
 
-		milli_sleep(detach_delay * 1000);
+		/* the device comes back on the same port in DFU mode */
+		if (*runtime_path) {
+			start = dfu_time_ms();
+			if (wait_dfu_device(ctx, runtime_path,
+					    detach_delay * 1000)) {
+				if (verbose)
+					printf("DFU mode device on port %s after "
+					       "%llu ms\n", runtime_path,
+					       dfu_time_ms() - start);
+			} else {
+				warnx("No DFU mode device on port %s after %i "
+				      "seconds", runtime_path, detach_delay);
+			}
+		} else {
+			milli_sleep(detach_delay * 1000);
+		}
+		free(runtime_path);
 
 		/* Change match vendor and product to impossible values to force
 		 * only DFU mode matches in the following probe */
@@ -496,6 +658,13 @@ int main(int argc, char **argv)
 
 		printf("Opening DFU USB Device...\n");
 		ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
+		/* device permissions may still be set up after arrival */
+		start = dfu_time_ms();
+		while (ret == LIBUSB_ERROR_ACCESS &&
+		       dfu_time_ms() - start < 1000) {
+			milli_sleep(100);
+			ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
+		}
 		if (ret || !dfu_root->dev_handle) {
 			errx(EX_IOERR, "Cannot open device");
 		}
@@ -516,12 +685,12 @@ dfustate:
 	}
 #endif
 	printf("Claiming USB DFU Interface...\n");
-	if (libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface) < 0) {
+	if (dfu_transport->claim_interface(dfu_root->dev_handle, dfu_root->interface) < 0) {
 		errx(EX_IOERR, "Cannot claim interface");
 	}
 
 	printf("Setting Alternate Setting #%d ...\n", dfu_root->altsetting);
-	if (libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, dfu_root->altsetting) < 0) {
+	if (dfu_transport->set_alt(dfu_root->dev_handle, dfu_root->interface, dfu_root->altsetting) < 0) {
 		errx(EX_IOERR, "Cannot set alternate interface");
 	}
 
@@ -582,6 +751,27 @@ status_again:
 	if (dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
 		dfuse_device = 1;
 
+	if (probe_transfer_size) {
+		unsigned int max_size = libusb_le16_to_cpu(
+		    dfu_root->func_dfu.wTransferSize);
+
+		/* uploads are not bound by the download buffer, but most
+		 * devices stall requests beyond it anyway */
+		if (!max_size)
+			max_size = 32768;
+		printf("Probing transfer size up to %i\n", max_size);
+		/* DfuSe uploads read from the address pointer, which may
+		 * point anywhere before the first SET_ADDRESS */
+		if (dfuse_device && dfuse_point_readable(dfu_root,
+		    dfuse_options ? strtoul(dfuse_options, NULL, 0) : 0) < 0)
+			warnx("No readable memory, probing at the current "
+			      "address");
+		transfer_size = dfuload_probe_xfer_size(dfu_root,
+		    dfu_root->bMaxPacketSize0, max_size, dfuse_device);
+		if (transfer_size)
+			printf("Probed transfer size %i\n", transfer_size);
+	}
+
 	/* If not overridden by the user */
 	if (!transfer_size) {
 		transfer_size = libusb_le16_to_cpu(
@@ -597,8 +787,9 @@ status_again:
 #ifdef HAVE_GETPAGESIZE
 /* autotools lie when cross-compiling for Windows using mingw32/64 */
 #ifndef __MINGW32__
-	/* limitation of Linux usbdevio */
-	if ((int)transfer_size > getpagesize()) {
+	/* limitation of Linux usbdevio, a probed size got through already */
+	if (!probe_transfer_size && !emulate && usbfs_size_limited() &&
+	    (int)transfer_size > getpagesize()) {
 		transfer_size = getpagesize();
 		printf("Limited transfer size to %i\n", transfer_size);
 	}
@@ -631,10 +822,7 @@ status_again:
 		break;
 
 	case MODE_DOWNLOAD:
-		if (((file.idVendor  != 0xffff && file.idVendor  != runtime_vendor) ||
-		     (file.idProduct != 0xffff && file.idProduct != runtime_product)) &&
-		    ((file.idVendor  != 0xffff && file.idVendor  != dfu_root->vendor) ||
-		     (file.idProduct != 0xffff && file.idProduct != dfu_root->product))) {
+		if (!file_ids_match(&file)) {
 			errx(EX_IOERR, "Error: File ID %04x:%04x does "
 				"not match device (%04x:%04x or %04x:%04x)",
 				file.idVendor, file.idProduct,
@@ -642,6 +830,11 @@ status_again:
 				dfu_root->vendor, dfu_root->product);
 		}
 		if (dfuse_device || dfuse_options || file.bcdDFU == 0x11a) {
+			/* only DfuSe downloads have addresses to put the
+			 * pieces of image files at, plain DFU devices get
+			 * the file as it is */
+			if (!file.source && file.bcdDFU != 0x11a)
+				dfu_image_parse(&file);
 		        if (dfuse_do_dnload(dfu_root, transfer_size, &file,
 							dfuse_options) < 0)
 				exit(1);
@@ -650,6 +843,16 @@ status_again:
 				exit(1);
 	 	}
 		break;
+	case MODE_BENCHMARK:
+		if (dfuse_device || dfuse_options) {
+			if (dfuse_do_benchmark(dfu_root, transfer_size,
+					       dfuse_options) < 0)
+				exit(1);
+		} else {
+			if (dfuload_do_benchmark(dfu_root, transfer_size) < 0)
+				exit(1);
+		}
+		break;
 	case MODE_DETACH:
 		if (dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000) < 0) {
 			warnx("can't detach");
@@ -667,13 +870,13 @@ status_again:
 			warnx("can't detach");
 		}
 		printf("Resetting USB to switch back to runtime mode\n");
-		ret = libusb_reset_device(dfu_root->dev_handle);
+		ret = dfu_transport->reset(dfu_root->dev_handle);
 		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
 			errx(EX_IOERR, "error resetting after download");
 		}
 	}
 
-	libusb_close(dfu_root->dev_handle);
+	dfu_transport->close(dfu_root->dev_handle);
 	dfu_root->dev_handle = NULL;
 	libusb_exit(ctx);
 
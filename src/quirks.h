@@ -22,6 +22,8 @@
 #define QUIRK_POLLTIMEOUT  (1<<0)
 #define QUIRK_FORCE_DFU11  (1<<1)
 #define QUIRK_GD32 (1<<2)
+/* DfuSe device ignores the block number, needs SET_ADDRESS for every block */
+#define QUIRK_DFUSE_SET_ADDRESS (1<<3)
 
 /* Fallback value, works for OpenMoko */
 #define DEFAULT_POLLTIMEOUT  5